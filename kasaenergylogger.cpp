@@ -28,34 +28,59 @@
 /////////////////////////////////////////////////////////////////////////////
 #include <algorithm>
 #include <arpa/inet.h>	// For inet_addr()
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <cfloat>
+#include <charconv>
+#include <chrono>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <getopt.h>
 #include <ifaddrs.h>	// for getifaddrs()
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <netdb.h>		// For gethostbyname()
 #include <netinet/in.h>	// For sockaddr_in
 #include <queue>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>	// For socket(), connect(), send(), and recv()
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <thread>
 #include <unistd.h>		// For close()
+#include <unordered_map>
 #include <utime.h>
 #include <vector>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 /////////////////////////////////////////////////////////////////////////////
 // URLs with information:
 // https://www.softscheck.com/en/reverse-engineering-tp-link-hs110/
@@ -102,15 +127,23 @@ std::string getTimeISO8601(void)
 
 	return(rval);
 }
-time_t ISO8601totime(const std::string& ISOTime)
+time_t ISO8601totime(const std::string_view ISOTime)
 {
 	struct tm UTC;
-	UTC.tm_year = stol(ISOTime.substr(0, 4)) - 1900;
-	UTC.tm_mon = stol(ISOTime.substr(5, 2)) - 1;
-	UTC.tm_mday = stol(ISOTime.substr(8, 2));
-	UTC.tm_hour = stol(ISOTime.substr(11, 2));
-	UTC.tm_min = stol(ISOTime.substr(14, 2));
-	UTC.tm_sec = stol(ISOTime.substr(17, 2));
+	if (ISOTime.size() < 19)
+		return(0);
+	auto Field = [ISOTime](const size_t pos, const size_t len)
+	{
+		int value = 0;
+		std::from_chars(ISOTime.data() + pos, ISOTime.data() + pos + len, value);
+		return(value);
+	};
+	UTC.tm_year = Field(0, 4) - 1900;
+	UTC.tm_mon = Field(5, 2) - 1;
+	UTC.tm_mday = Field(8, 2);
+	UTC.tm_hour = Field(11, 2);
+	UTC.tm_min = Field(14, 2);
+	UTC.tm_sec = Field(17, 2);
 	UTC.tm_gmtoff = 0;
 	UTC.tm_isdst = -1;
 	UTC.tm_zone = 0;
@@ -182,65 +215,317 @@ std::string timeToExcelLocal(const time_t& TheTime)
 	return(ExcelDate.str());
 }
 /////////////////////////////////////////////////////////////////////////////
+// The devices respond with small JSON documents, and my log lines are those
+// responses with a date and deviceId prepended. Rather than carving up copies
+// of the text for every key I'm interested in, this walks the text a single
+// time from front to back handing out each "key":value pair it passes.
+// Objects and arrays are walked into, so keys at every depth are visited.
+// Nothing is allocated, the returned views point into the original text.
+class CKasaJSONScanner {
+public:
+	CKasaJSONScanner(const std::string_view text) : Text(text), Position(0) { };
+	bool Next(std::string_view& Key, std::string_view& Value);
+protected:
+	std::string_view Text;
+	size_t Position;
+};
+bool CKasaJSONScanner::Next(std::string_view& Key, std::string_view& Value)
+{
+	while (Position < Text.size())
+	{
+		auto KeyStart = Text.find('"', Position);
+		if (KeyStart == std::string_view::npos)
+			break;
+		auto KeyEnd = Text.find('"', KeyStart + 1);
+		if (KeyEnd == std::string_view::npos)
+			break;
+		Position = KeyEnd + 1;
+		while ((Position < Text.size()) && isspace(static_cast<unsigned char>(Text[Position])))
+			Position++;
+		if ((Position >= Text.size()) || (Text[Position] != ':'))
+			continue;	// A quoted string that isn't followed by a colon is an array element, not a key
+		Position++;
+		while ((Position < Text.size()) && isspace(static_cast<unsigned char>(Text[Position])))
+			Position++;
+		if (Position >= Text.size())
+			break;
+		Key = Text.substr(KeyStart + 1, KeyEnd - KeyStart - 1);
+		if (Text[Position] == '"')
+		{
+			auto ValueStart = ++Position;
+			while ((Position < Text.size()) && (Text[Position] != '"'))
+				Position += (Text[Position] == '\\') ? 2 : 1;	// step over escaped characters
+			Value = Text.substr(ValueStart, std::min(Position, Text.size()) - ValueStart);
+			Position++;
+		}
+		else if ((Text[Position] == '{') || (Text[Position] == '['))
+		{
+			Value = Text.substr(Position, 1);	// Leave Position on the bracket so the contents get scanned next
+			Position++;
+		}
+		else
+		{
+			auto ValueEnd = Text.find_first_of(",}] \t\r\n", Position);
+			if (ValueEnd == std::string_view::npos)
+				ValueEnd = Text.size();
+			Value = Text.substr(Position, ValueEnd - Position);
+			Position = ValueEnd;
+		}
+		return(true);
+	}
+	Position = Text.size();
+	return(false);
+}
+// Returns the first value found for Key anywhere in the text.
+bool KasaJSONFind(const std::string_view Text, const std::string_view Key, std::string_view& Value)
+{
+	CKasaJSONScanner Scanner(Text);
+	std::string_view ScanKey;
+	while (Scanner.Next(ScanKey, Value))
+		if (ScanKey == Key)
+			return(true);
+	return(false);
+}
+// Returns the length of the object or array starting at Text[0], including the closing bracket.
+size_t KasaJSONSpan(const std::string_view Text)
+{
+	int Depth = 0;
+	bool InString = false;
+	for (size_t index = 0; index < Text.size(); index++)
+	{
+		if (InString)
+		{
+			if (Text[index] == '\\')
+				index++;
+			else if (Text[index] == '"')
+				InString = false;
+		}
+		else if (Text[index] == '"')
+			InString = true;
+		else if ((Text[index] == '{') || (Text[index] == '['))
+			Depth++;
+		else if ((Text[index] == '}') || (Text[index] == ']'))
+			if (--Depth == 0)
+				return(index + 1);
+	}
+	return(Text.size());
+}
+template <typename T>
+bool KasaJSONNumber(const std::string_view Value, T& Number)
+{
+	auto [ptr, ec] = std::from_chars(Value.data(), Value.data() + Value.size(), Number);
+	return(ec == std::errc());
+}
+/////////////////////////////////////////////////////////////////////////////
+// Each encrypted byte is the plain byte XORed with the previous encrypted byte, starting from 0xAB.
+// Encrypting is a running XOR over the input, which is done sixteen bytes at a time by XORing each
+// block with itself shifted by 1, 2, 4 and 8 bytes and then with the last encrypted byte before it.
+// Decrypting only needs each encrypted byte and the one before it, so whole blocks are independent.
+// SSE2 is part of every x86-64 processor and NEON of every 64 bit ARM, so these are picked at compile time.
 void KasaEncrypt(const std::string &input, uint8_t * output)
 {
+	const uint8_t * data = (const uint8_t *)input.data();
+	const size_t len = input.length();
 	uint8_t key = 0xAB;
-	for (auto it = input.begin(); it != input.end(); it++)
+	size_t index = 0;
+#if defined(__SSE2__)
+	for (; index + 16 <= len; index += 16)
 	{
-		uint8_t a = key ^ *it;
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + index));
+		block = _mm_xor_si128(block, _mm_slli_si128(block, 1));
+		block = _mm_xor_si128(block, _mm_slli_si128(block, 2));
+		block = _mm_xor_si128(block, _mm_slli_si128(block, 4));
+		block = _mm_xor_si128(block, _mm_slli_si128(block, 8));
+		block = _mm_xor_si128(block, _mm_set1_epi8(char(key)));
+		_mm_storeu_si128((__m128i *)(output + index), block);
+		key = output[index + 15];
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t zero = vdupq_n_u8(0);
+	for (; index + 16 <= len; index += 16)
+	{
+		uint8x16_t block = vld1q_u8(data + index);
+		block = veorq_u8(block, vextq_u8(zero, block, 15));
+		block = veorq_u8(block, vextq_u8(zero, block, 14));
+		block = veorq_u8(block, vextq_u8(zero, block, 12));
+		block = veorq_u8(block, vextq_u8(zero, block, 8));
+		block = veorq_u8(block, vdupq_n_u8(key));
+		vst1q_u8(output + index, block);
+		key = output[index + 15];
+	}
+#endif
+	for (; index < len; index++)
+	{
+		uint8_t a = key ^ data[index];
 		key = a;
-		*output++ = a;
+		output[index] = a;
 	}
 }
-void KasaDecrypt(const size_t len, const uint8_t input[], std::string &output)
+// Decrypts len bytes in place and returns them as text. key is the encrypted byte that came just
+// before data, which is 0xAB at the start of a message. Working from the end back to the start
+// means every byte still has its encrypted neighbor available when it's decrypted.
+std::string_view KasaDecrypt(uint8_t * data, const size_t len, const uint8_t key = 0xAB)
 {
-	output.clear();
-	output.reserve(len);	// minor optimization, not required but efficient
-	uint8_t key = 0xAB;
-	for (size_t index = 0; index < len; index++)
+	size_t index = len;
+#if defined(__SSE2__)
+	for (; index >= 17; index -= 16)
 	{
-		uint8_t a = key ^ input[index];
-		key = input[index];
-		output += a;
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + index - 16));
+		__m128i previous = _mm_loadu_si128((const __m128i *)(data + index - 17));
+		_mm_storeu_si128((__m128i *)(data + index - 16), _mm_xor_si128(block, previous));
+	}
+#elif defined(__ARM_NEON)
+	for (; index >= 17; index -= 16)
+		vst1q_u8(data + index - 16, veorq_u8(vld1q_u8(data + index - 16), vld1q_u8(data + index - 17)));
+#endif
+	for (; index > 1; index--)
+		data[index - 1] ^= data[index - 2];
+	if (len > 0)
+		data[0] ^= key;
+	return(std::string_view((const char *)data, len));
+}
+// Reassembles the responses a device sends over TCP, each a four byte big endian length followed by that
+// many encrypted bytes. Bytes are decrypted in place as they arrive, however the stream happens to be split,
+// so a response is ready to use as soon as its last byte is received. The buffer is kept between responses.
+class CKasaFrameReader {
+public:
+	static const size_t MaxFrameSize = 64 * 1024;	// Much larger than any real response, anything longer means the stream is out of step
+	CKasaFrameReader() { Reset(); };
+	void Reset(void);
+	uint8_t * WriteSpace(const size_t Wanted);	// Room for at least Wanted more bytes
+	void Commit(const size_t Length);	// Length bytes were written to the WriteSpace
+	bool Next(std::string_view& Frame);	// The next complete decrypted response, valid until WriteSpace is called
+	bool Malformed(void) const { return(bMalformed); };
+	size_t MalformedLength(void) const { return(FrameLength); };
+protected:
+	void Decode(void);
+	std::vector<uint8_t> Buffer;
+	size_t Begin;	// Start of the current frame's length prefix
+	size_t Decoded;	// Everything before this has been decrypted
+	size_t End;	// Everything before this has been received
+	size_t FrameLength;	// Length of the current frame, once its prefix has arrived
+	uint8_t Key;
+	bool bMalformed;
+};
+void CKasaFrameReader::Reset(void)
+{
+	Begin = Decoded = End = FrameLength = 0;
+	Key = 0xAB;
+	bMalformed = false;
+}
+uint8_t * CKasaFrameReader::WriteSpace(const size_t Wanted)
+{
+	if (Begin > 0)
+	{
+		// Completed frames have been handed out, so what's left moves to the front
+		memmove(Buffer.data(), Buffer.data() + Begin, End - Begin);
+		Decoded -= Begin;
+		End -= Begin;
+		Begin = 0;
+	}
+	if (Buffer.size() < End + Wanted)
+		Buffer.resize(End + Wanted);
+	return(Buffer.data() + End);
+}
+void CKasaFrameReader::Commit(const size_t Length)
+{
+	End += Length;
+	Decode();
+}
+void CKasaFrameReader::Decode(void)
+{
+	if ((!bMalformed) && (Decoded - Begin < sizeof(uint32_t)) && (End - Begin >= sizeof(uint32_t)))
+	{
+		uint32_t NetworkLength;
+		memcpy(&NetworkLength, Buffer.data() + Begin, sizeof(NetworkLength));
+		FrameLength = ntohl(NetworkLength);
+		Decoded = Begin + sizeof(uint32_t);
+		Key = 0xAB;
+		bMalformed = (FrameLength > MaxFrameSize);
+	}
+	if ((!bMalformed) && (Decoded - Begin >= sizeof(uint32_t)))
+	{
+		const size_t FrameEnd = std::min(End, Begin + sizeof(uint32_t) + FrameLength);
+		if (Decoded < FrameEnd)
+		{
+			const uint8_t NextKey = Buffer[FrameEnd - 1];
+			KasaDecrypt(Buffer.data() + Decoded, FrameEnd - Decoded, Key);
+			Key = NextKey;
+			Decoded = FrameEnd;
+		}
 	}
 }
+bool CKasaFrameReader::Next(std::string_view& Frame)
+{
+	if (bMalformed || (Decoded - Begin < sizeof(uint32_t)) || (Decoded < Begin + sizeof(uint32_t) + FrameLength))
+		return(false);
+	Frame = std::string_view((const char *)Buffer.data() + Begin + sizeof(uint32_t), FrameLength);
+	Begin = Decoded;
+	FrameLength = 0;
+	Decode();	// the next frame may already be here
+	return(true);
+}
 /////////////////////////////////////////////////////////////////////////////
 // https://github.com/softScheck/tplink-smartplug/blob/master/tplink-smarthome-commands.txt
 const uint8_t KasaBroadcast[] =	"{\"system\":{\"get_sysinfo\":{}},\"emeter\":{\"get_realtime\":{}},\"smartlife.iot.common.emeter\":{\"get_realtime\":{}}}";
 const uint8_t KasaWiFi[] =		"{\"netif\":{\"set_stainfo\":{\"ssid\":\"WiFi\", \"password\" : \"secret\", \"key_type\" : 3}}}";	// Connect to AP with given SSID and Password
 /////////////////////////////////////////////////////////////////////////////
+// Everything known about one device that's polled for energy usage. The device ID is parsed from
+// the discovery response once, and is the key the client is stored under in the registry.
 class CKasaClient {
 public:
-	struct sockaddr address;
+	CKasaClient(const struct sockaddr& TheAddress, const time_t TheDate, const std::string& TheInformation, const std::string& TheParentID = std::string())
+		: AddressGeneration(0), date(TheDate), information(TheInformation), DeviceID(ParseDeviceID(TheInformation)), ParentID(TheParentID) { SetAddress(TheAddress); };
+	bool SetAddress(const struct sockaddr& TheAddress);	// Returns true if the address changed
+	struct sockaddr_storage ConnectAddress;	// address with the Kasa TCP port, ready to hand to connect()
+	socklen_t ConnectAddressLength;
+	std::string NumericHost;	// ConnectAddress without the port as text, for messages
+	unsigned int AddressGeneration;	// counts address changes, so a connection made to an older address can be recognised
 	time_t date;
 	std::string information;
-	std::string GetDeviceID(void) const;
+	std::string DeviceID;
+	std::string ParentID;	// For an outlet on a power strip, the DeviceID of the strip, otherwise empty
+	std::vector<std::string> Children;	// For a power strip, the DeviceID of each outlet
+	const std::string& GetDeviceID(void) const { return(DeviceID); };
+	static std::string ParseDeviceID(const std::string_view TheInformation);
 };
-std::string CKasaClient::GetDeviceID(void) const
+bool CKasaClient::SetAddress(const struct sockaddr& TheAddress)
 {
-	std::string DeviceID;
-	auto pos = information.find("\"deviceId\"");
-	if (pos == std::string::npos)
-		pos = information.find("\"id\"");
-	if (pos != std::string::npos)
+	// Discovery is an IPv4 broadcast, so that's the only kind of address a device reports from
+	struct sockaddr_storage NewAddress;
+	memset(&NewAddress, 0, sizeof(NewAddress));
+	if (TheAddress.sa_family == AF_INET)
 	{
-		// HACK: I need to clean this up..  
-		DeviceID = information.substr(pos);	// value starts at key
-		DeviceID.erase(DeviceID.find_first_of(",}"));	// truncate value
-		DeviceID.erase(0, DeviceID.find(':'));	// move past key value
-		DeviceID.erase(DeviceID.find(':'), 1);	// move past seperator
-		DeviceID.erase(DeviceID.find('"'), 1);	// erase leading quote
-		DeviceID.erase(DeviceID.find('"'), 1);	// erase trailing quote
+		struct sockaddr_in * foo = (struct sockaddr_in *)&NewAddress;
+		foo->sin_family = AF_INET;
+		foo->sin_addr = ((const struct sockaddr_in *)&TheAddress)->sin_addr;
+		foo->sin_port = htons(9999);
 	}
-	return(DeviceID);
+	if ((!NumericHost.empty()) && (0 == memcmp(&ConnectAddress, &NewAddress, sizeof(NewAddress))))
+		return(false);
+	ConnectAddress = NewAddress;
+	AddressGeneration++;
+	ConnectAddressLength = (NewAddress.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : 0;
+	char ClientHostname[INET6_ADDRSTRLEN] = { 0 };
+	if (NewAddress.ss_family == AF_INET)
+		inet_ntop(AF_INET, &(((struct sockaddr_in *)&ConnectAddress)->sin_addr), ClientHostname, INET6_ADDRSTRLEN);
+	NumericHost = ClientHostname;
+	return(true);
 }
-/////////////////////////////////////////////////////////////////////////////
-// The following operator was required so I could use the std::map<> to use CKasaClient as the key
-bool operator <(const CKasaClient &a, const CKasaClient &b)
+std::string CKasaClient::ParseDeviceID(const std::string_view TheInformation)
 {
-	std::string AdeviceId(a.GetDeviceID());
-	std::string BdeviceId(b.GetDeviceID());
-	return(AdeviceId.compare(BdeviceId) < 0);
+	// Top level devices report a "deviceId", child outlets only have an "id"
+	std::string_view DeviceID;
+	CKasaJSONScanner Scanner(TheInformation);
+	std::string_view Key, Value;
+	while (Scanner.Next(Key, Value))
+	{
+		if (Key == "deviceId")
+			return(std::string(Value));
+		if ((Key == "id") && DeviceID.empty())
+			DeviceID = Value;
+	}
+	return(std::string(DeviceID));
 }
 /////////////////////////////////////////////////////////////////////////////
 int ConsoleVerbosity = 1;
@@ -248,6 +533,11 @@ std::string LogDirectory("./");
 std::string SVGDirectory;	// If this remains empty, SVG Files are not created. If it's specified, _day, _week, _month, and _year.svg files are created for each address seen.
 int SVGMinMax = 0; // 0x01 = Draw Watts and Volts Minimum and Maximum line on daily, 0x02 = on weekly, 0x04 = on monthly, 0x08 = on yearly
 int SVGWattHour = 0; // 0x01 = Draw Total Watt Hours on daily, 0x02 = on weekly, 0x04 = on monthly, 0x08 = on yearly
+bool SVGGzip = false; // Also write each graph gzip compressed beside the SVG file, as name.svg.gz
+int SVGThreadCount = 0; // Number of threads rendering SVG files, 0 = one per hardware thread
+bool PersistentConnections = false; // Keep the TCP connection to each device open between polls instead of connecting every time
+bool LogSegments = false; // Log readings to binary .seg segments instead of lines of JSON in .txt files
+bool LogCompress = false; // Gzip each text log once its month is over, as .txt.gz
 // The following details were taken from https://github.com/oetiker/mrtg
 const size_t DAY_COUNT = 600;			/* 400 samples is 33.33 hours */
 const size_t WEEK_COUNT = 600;			/* 400 samples is 8.33 days */
@@ -259,41 +549,58 @@ const size_t MONTH_SAMPLE = 2 * 60 * 60;/* Sample every 2 hours */
 const size_t YEAR_SAMPLE = 24 * 60 * 60;/* Sample every 24 hours */
 /////////////////////////////////////////////////////////////////////////////
 // Class I'm using for storing power usage data from the Kasa devices
+// Values are kept in the integer milli-units the newer devices report (mW, mV, mA, mWh)
+// and only converted to watts, volts, and amps when they are asked for.
 class  CKASAReading {
 public:
 	time_t Time;
-	CKASAReading() : Time(0), Watts(0), WattsMin(DBL_MAX), WattsMax(DBL_MIN), Volts(0), VoltsMin(DBL_MAX), VoltsMax(DBL_MIN), Amps(0), AmpsMin(DBL_MAX), AmpsMax(DBL_MIN), TotalWattHours(0), Averages(0) { };
-	CKASAReading(const std::string data);
-	double GetWatts(void) const { return(Watts); };
-	double GetWattsMin(void) const { return(std::min(Watts, WattsMin)); };
-	double GetWattsMax(void) const { return(std::max(Watts, WattsMax)); };
-	double GetVolts(void) const { return(Volts); };
-	double GetVoltsMin(void) const { return(std::min(Volts, VoltsMin)); };
-	double GetVoltsMax(void) const { return(std::max(Volts, VoltsMax)); };
-	double GetAmps(void) const { return(Amps); };
-	double GetAmpsMin(void) const { return(std::min(Amps, AmpsMin)); };
-	double GetAmpsMax(void) const { return(std::max(Amps, AmpsMax)); };
-	double GetTotalWattHours(void) const { return(TotalWattHours); };
-	std::string GetDeviceID(void) const { return(DeviceID); };
+	CKASAReading() : Time(0), MilliWatts(0), MilliWattsMin(INT32_MAX), MilliWattsMax(INT32_MIN), MilliVolts(0), MilliVoltsMin(INT32_MAX), MilliVoltsMax(INT32_MIN), MilliAmps(0), MilliAmpsMin(INT32_MAX), MilliAmpsMax(INT32_MIN), MilliWattHours(0), Averages(0) { };
+	CKASAReading(const std::string_view TheLine, std::string_view* TheDeviceID = NULL);
+	double GetWatts(void) const { return(MilliWatts / 1000.0); };
+	double GetWattsMin(void) const { return(std::min(MilliWatts, MilliWattsMin) / 1000.0); };
+	double GetWattsMax(void) const { return(std::max(MilliWatts, MilliWattsMax) / 1000.0); };
+	double GetVolts(void) const { return(MilliVolts / 1000.0); };
+	double GetVoltsMin(void) const { return(std::min(MilliVolts, MilliVoltsMin) / 1000.0); };
+	double GetVoltsMax(void) const { return(std::max(MilliVolts, MilliVoltsMax) / 1000.0); };
+	double GetAmps(void) const { return(MilliAmps / 1000.0); };
+	double GetAmpsMin(void) const { return(std::min(MilliAmps, MilliAmpsMin) / 1000.0); };
+	double GetAmpsMax(void) const { return(std::max(MilliAmps, MilliAmpsMax) / 1000.0); };
+	double GetTotalWattHours(void) const { return(MilliWattHours / 1000.0); };
 	enum granularity { day, week, month, year };
 	void NormalizeTime(granularity type);
 	granularity GetTimeGranularity(void) const;
 	bool IsValid(void) const { return(Averages > 0); };
 	CKASAReading& operator +=(const CKASAReading &b);
 protected:
-	double Watts;
-	double WattsMin;
-	double WattsMax;
-	double Volts;
-	double VoltsMin;
-	double VoltsMax;
-	double Amps;
-	double AmpsMin;
-	double AmpsMax;
-	double TotalWattHours;
-	int Averages;
-	std::string DeviceID;
+	int32_t MilliWatts;
+	int32_t MilliWattsMin;
+	int32_t MilliWattsMax;
+	int32_t MilliVolts;
+	int32_t MilliVoltsMin;
+	int32_t MilliVoltsMax;
+	int32_t MilliAmps;
+	int32_t MilliAmpsMin;
+	int32_t MilliAmpsMax;
+	int64_t MilliWattHours;
+	int32_t Averages;
+	friend class CMRTGTier;
+	friend class CLogSegment;
 };
+// Weighted averages are kept in integers, rounded to the nearest milli-unit
+static int32_t RoundedAverage(const int64_t Sum, const int64_t Count)
+{
+	return(int32_t((Sum >= 0) ? (Sum + Count / 2) / Count : (Sum - Count / 2) / Count));
+}
+// The older devices report floating point units, convert them to milli-units
+template <typename T>
+bool KasaJSONMilli(const std::string_view Value, T& Milli)
+{
+	double Number = 0;
+	if (!KasaJSONNumber(Value, Number))
+		return(false);
+	Milli = T(std::llround(Number * 1000.0));
+	return(true);
+}
 void CKASAReading::NormalizeTime(granularity type)
 {
 	if (type == day)
@@ -330,561 +637,1217 @@ CKASAReading::granularity CKASAReading::GetTimeGranularity(void) const
 	}
 	return(rval);
 }
-CKASAReading::CKASAReading(const std::string TheLine)
+CKASAReading::CKASAReading(const std::string_view TheLine, std::string_view* TheDeviceID) : CKASAReading()
 {
 	// {"date":"2021-04-23 19:02:25","deviceId":"8006C12BF70963C01E916C3F54E742CC1C0B3FAB01",{"emeter":{"get_realtime":{"voltage_mv":121122,"current_ma":106,"power_mw":8464,"total_wh":136,"err_code":0}}}}
 	// {"date":"2021-04-23 19:03:25","deviceId":"8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D",{"emeter":{"get_realtime":{"current":0.013229,"voltage":122.296761,"power":0,"total":0,"err_code":0}}}}
-	Averages = 1;
-
-	auto pos = TheLine.find("\"date\"");
-	if (pos != std::string::npos)
-	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		Value.erase(Value.find('"'), 1);
-		Value.erase(Value.find('"'), 1);
-		Time = ISO8601totime(Value);
-	}
-
-	pos = TheLine.find("\"deviceId\"");
-	if (pos != std::string::npos)
-	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		Value.erase(Value.find('"'), 1);
-		Value.erase(Value.find('"'), 1);
-		DeviceID = Value;
-	}
-
-	pos = TheLine.find("\"current\"");
-	if (pos != std::string::npos)
-	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		Amps = AmpsMin = AmpsMax = std::stod(Value.c_str());
-	}
-
-	pos = TheLine.find("\"voltage\"");
-	if (pos != std::string::npos)
-	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		Volts = VoltsMin = VoltsMax = std::stod(Value.c_str());
-	}
-
-	pos = TheLine.find("\"power\"");
-	if (pos != std::string::npos)
-	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		Watts = WattsMin = WattsMax = std::stod(Value.c_str());
-	}
-
-	pos = TheLine.find("\"total\"");
-	if (pos != std::string::npos)
+	CKasaJSONScanner Scanner(TheLine);
+	std::string_view Key, Value;
+	while (Scanner.Next(Key, Value))
 	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		TotalWattHours = std::stod(Value);
+		if (Key == "date")
+		{
+			Time = ISO8601totime(Value);
+			Averages = 1;	// A line without a date isn't a reading
+		}
+		else if (Key == "deviceId")
+		{
+			if (TheDeviceID != NULL)
+				*TheDeviceID = Value;
+		}
+		else if (Key == "current")
+		{
+			if (KasaJSONMilli(Value, MilliAmps))
+				MilliAmpsMin = MilliAmpsMax = MilliAmps;
+		}
+		else if (Key == "voltage")
+		{
+			if (KasaJSONMilli(Value, MilliVolts))
+				MilliVoltsMin = MilliVoltsMax = MilliVolts;
+		}
+		else if (Key == "power")
+		{
+			if (KasaJSONMilli(Value, MilliWatts))
+				MilliWattsMin = MilliWattsMax = MilliWatts;
+		}
+		else if (Key == "total")
+			KasaJSONMilli(Value, MilliWattHours);
+		else if (Key == "current_ma")
+		{
+			if (KasaJSONNumber(Value, MilliAmps))
+				MilliAmpsMin = MilliAmpsMax = MilliAmps;
+		}
+		else if (Key == "voltage_mv")
+		{
+			if (KasaJSONNumber(Value, MilliVolts))
+				MilliVoltsMin = MilliVoltsMax = MilliVolts;
+		}
+		else if (Key == "power_mw")
+		{
+			if (KasaJSONNumber(Value, MilliWatts))
+				MilliWattsMin = MilliWattsMax = MilliWatts;
+		}
+		else if (Key == "total_wh")
+		{
+			if (KasaJSONNumber(Value, MilliWattHours))
+				MilliWattHours *= 1000;
+		}
 	}
-
-	pos = TheLine.find("\"current_ma\"");
-	if (pos != std::string::npos)
+}
+CKASAReading& CKASAReading::operator +=(const CKASAReading &b)
+{
+	if (b.IsValid())
 	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		long long current_ma = std::stol(Value);
-		Amps = AmpsMin = AmpsMax = current_ma / 1000.0;
+		const int64_t Count = int64_t(Averages) + b.Averages;
+		Time = std::max(Time, b.Time); // Use the maximum time (newest time)
+		MilliWatts = RoundedAverage(int64_t(MilliWatts) * Averages + int64_t(b.MilliWatts) * b.Averages, Count);	// weighted average
+		MilliWattsMin = std::min(std::min(MilliWatts, MilliWattsMin), b.MilliWattsMin);
+		MilliWattsMax = std::max(std::max(MilliWatts, MilliWattsMax), b.MilliWattsMax);
+		MilliVolts = RoundedAverage(int64_t(MilliVolts) * Averages + int64_t(b.MilliVolts) * b.Averages, Count);	// weighted average
+		MilliVoltsMin = std::min(std::min(MilliVolts, MilliVoltsMin), b.MilliVoltsMin);
+		MilliVoltsMax = std::max(std::max(MilliVolts, MilliVoltsMax), b.MilliVoltsMax);
+		MilliAmps = RoundedAverage(int64_t(MilliAmps) * Averages + int64_t(b.MilliAmps) * b.Averages, Count);	// weighted average
+		MilliAmpsMin = std::min(std::min(MilliAmps, MilliAmpsMin), b.MilliAmpsMin);
+		MilliAmpsMax = std::max(std::max(MilliAmps, MilliAmpsMax), b.MilliAmpsMax);
+		MilliWattHours = std::max(MilliWattHours, b.MilliWattHours);
+		Averages = int32_t(Count); // existing average + new average
 	}
-
-	pos = TheLine.find("\"voltage_mv\"");
-	if (pos != std::string::npos)
+	return(*this);
+}
+/////////////////////////////////////////////////////////////////////////////
+// Fixed length circular buffer of samples. Index 0 is always the newest sample and the
+// highest index the oldest, so inserting a new sample only moves the head.
+// Each field is kept in its own column so that rolling samples up walks contiguous memory.
+class CMRTGTier {
+public:
+	CMRTGTier(const size_t count) : Time(count), MilliWatts(count), MilliWattsMin(count, INT32_MAX), MilliWattsMax(count, INT32_MIN), MilliVolts(count), MilliVoltsMin(count, INT32_MAX), MilliVoltsMax(count, INT32_MIN), MilliAmps(count), MilliAmpsMin(count, INT32_MAX), MilliAmpsMax(count, INT32_MIN), MilliWattHours(count), Averages(count), Head(0) { };
+	size_t size(void) const { return(Time.size()); };
+	CKASAReading Get(const size_t index) const;
+	void Set(const size_t index, const CKASAReading& TheValue);
+	time_t GetTime(const size_t index) const { return(Time[Position(index)]); };
+	void SetTime(const size_t index, const time_t TheTime) { Time[Position(index)] = TheTime; };
+	bool IsValid(const size_t index) const { return(Averages[Position(index)] > 0); };
+	void push_front(const CKASAReading& TheValue) { Head = Position(size() - 1); Set(0, TheValue); };
+	void rotate(const size_t count) { Head = Position(size() - (count % size())); };	// makes room for count new samples at the front
+	CKASAReading Rollup(const size_t count) const;
+protected:
+	size_t Position(const size_t index) const { size_t pos = Head + index; return((pos < size()) ? pos : pos - size()); };
+	std::vector<time_t> Time;
+	std::vector<int32_t> MilliWatts;
+	std::vector<int32_t> MilliWattsMin;
+	std::vector<int32_t> MilliWattsMax;
+	std::vector<int32_t> MilliVolts;
+	std::vector<int32_t> MilliVoltsMin;
+	std::vector<int32_t> MilliVoltsMax;
+	std::vector<int32_t> MilliAmps;
+	std::vector<int32_t> MilliAmpsMin;
+	std::vector<int32_t> MilliAmpsMax;
+	std::vector<int64_t> MilliWattHours;
+	std::vector<int32_t> Averages;
+	size_t Head;
+};
+CKASAReading CMRTGTier::Get(const size_t index) const
+{
+	const size_t pos = Position(index);
+	CKASAReading rval;
+	rval.Time = Time[pos];
+	rval.MilliWatts = MilliWatts[pos];
+	rval.MilliWattsMin = MilliWattsMin[pos];
+	rval.MilliWattsMax = MilliWattsMax[pos];
+	rval.MilliVolts = MilliVolts[pos];
+	rval.MilliVoltsMin = MilliVoltsMin[pos];
+	rval.MilliVoltsMax = MilliVoltsMax[pos];
+	rval.MilliAmps = MilliAmps[pos];
+	rval.MilliAmpsMin = MilliAmpsMin[pos];
+	rval.MilliAmpsMax = MilliAmpsMax[pos];
+	rval.MilliWattHours = MilliWattHours[pos];
+	rval.Averages = Averages[pos];
+	return(rval);
+}
+void CMRTGTier::Set(const size_t index, const CKASAReading& TheValue)
+{
+	const size_t pos = Position(index);
+	Time[pos] = TheValue.Time;
+	MilliWatts[pos] = TheValue.MilliWatts;
+	MilliWattsMin[pos] = TheValue.MilliWattsMin;
+	MilliWattsMax[pos] = TheValue.MilliWattsMax;
+	MilliVolts[pos] = TheValue.MilliVolts;
+	MilliVoltsMin[pos] = TheValue.MilliVoltsMin;
+	MilliVoltsMax[pos] = TheValue.MilliVoltsMax;
+	MilliAmps[pos] = TheValue.MilliAmps;
+	MilliAmpsMin[pos] = TheValue.MilliAmpsMin;
+	MilliAmpsMax[pos] = TheValue.MilliAmpsMax;
+	MilliWattHours[pos] = TheValue.MilliWattHours;
+	Averages[pos] = TheValue.Averages;
+}
+// Combines up to count of the newest samples into a single sample, stopping at the first invalid sample.
+CKASAReading CMRTGTier::Rollup(const size_t count) const
+{
+	CKASAReading rval;
+	size_t Valid = 0;
+	while ((Valid < std::min(count, size())) && (Averages[Position(Valid)] > 0))
+		Valid++;
+	int64_t SumWatts = 0, SumVolts = 0, SumAmps = 0, SumAverages = 0;
+	for (size_t index = 0; index < Valid; index++)
 	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		long long voltage_mv = std::stol(Value);
-		Volts = VoltsMin = VoltsMax = voltage_mv / 1000.0;
+		const size_t pos = Position(index);
+		SumWatts += int64_t(MilliWatts[pos]) * Averages[pos];
+		SumVolts += int64_t(MilliVolts[pos]) * Averages[pos];
+		SumAmps += int64_t(MilliAmps[pos]) * Averages[pos];
+		SumAverages += Averages[pos];
 	}
-
-	pos = TheLine.find("\"power_mw\"");
-	if (pos != std::string::npos)
+	for (size_t index = 0; index < Valid; index++)
 	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		long long power_mw = std::stol(Value);
-		Watts = WattsMin = WattsMax = power_mw / 1000.0;
+		const size_t pos = Position(index);
+		rval.Time = std::max(rval.Time, Time[pos]);
+		rval.MilliWattsMin = std::min(rval.MilliWattsMin, std::min(MilliWatts[pos], MilliWattsMin[pos]));
+		rval.MilliWattsMax = std::max(rval.MilliWattsMax, std::max(MilliWatts[pos], MilliWattsMax[pos]));
+		rval.MilliVoltsMin = std::min(rval.MilliVoltsMin, std::min(MilliVolts[pos], MilliVoltsMin[pos]));
+		rval.MilliVoltsMax = std::max(rval.MilliVoltsMax, std::max(MilliVolts[pos], MilliVoltsMax[pos]));
+		rval.MilliAmpsMin = std::min(rval.MilliAmpsMin, std::min(MilliAmps[pos], MilliAmpsMin[pos]));
+		rval.MilliAmpsMax = std::max(rval.MilliAmpsMax, std::max(MilliAmps[pos], MilliAmpsMax[pos]));
+		rval.MilliWattHours = std::max(rval.MilliWattHours, MilliWattHours[pos]);
 	}
-
-	pos = TheLine.find("\"total_wh\"");
-	if (pos != std::string::npos)
+	if (SumAverages > 0)
 	{
-		// HACK: I need to clean this up..  
-		std::string Value(TheLine.substr(pos));	// value starts at key
-		Value.erase(Value.find_first_of(",}"));	// truncate value
-		Value.erase(0, Value.find(':'));	// move past key value
-		Value.erase(Value.find(':'), 1);	// move past seperator
-		TotalWattHours = std::stol(Value);
+		rval.MilliWatts = RoundedAverage(SumWatts, SumAverages);
+		rval.MilliVolts = RoundedAverage(SumVolts, SumAverages);
+		rval.MilliAmps = RoundedAverage(SumAmps, SumAverages);
+		rval.Averages = int32_t(SumAverages);
 	}
+	return(rval);
 }
-CKASAReading& CKASAReading::operator +=(const CKASAReading &b)
+enum class GraphType { daily, weekly, monthly, yearly };
+// The in memory equivalent of an MRTG log file for one device. Current is the most 
+// recent reading, Accumulator collects readings until the next day sample boundary.
+// Dirty marks the graphs whose data has changed since they were last written, indexed by GraphType.
+class CMRTGLog {
+public:
+	CMRTGLog() : Day(DAY_COUNT), Week(WEEK_COUNT), Month(MONTH_COUNT), Year(YEAR_COUNT), Dirty{ true, true, true, true }, Generation(0) { };
+	CKASAReading Current;
+	CKASAReading Accumulator;
+	CMRTGTier Day;
+	CMRTGTier Week;
+	CMRTGTier Month;
+	CMRTGTier Year;
+	bool Dirty[4];
+	uint64_t Generation;	// changes with every reading, so anything built from the log can tell it's out of date
+};
+std::map<std::string, CMRTGLog, std::less<>> KasaMRTGLogs; // memory map of deviceId and ring buffer structure similar to MRTG Log Files
+std::map<std::string, std::string> KasaTitles;
+// Fills Count consecutive day samples with copies of TheValue, along with the week, month, and year 
+// samples that fall on those boundaries. Only valid when every day sample that would be averaged
+// into a coarser sample is a copy of TheValue, which is true once a gap is longer than a day.
+void FastForwardMRTGData(CMRTGLog& FakeMRTGFile, const CKASAReading& TheValue, const size_t Count)
 {
-	if (b.IsValid())
+	const time_t FirstTime = FakeMRTGFile.Day.GetTime(0) + DAY_SAMPLE;
+	FakeMRTGFile.Day.rotate(Count);
+	for (size_t index = 0; index < std::min(Count, FakeMRTGFile.Day.size()); index++)
 	{
-		Time = std::max(Time, b.Time); // Use the maximum time (newest time)
-		Watts = ((Watts * Averages) + (b.Watts * b.Averages)) / (Averages + b.Averages);	// weighted average
-		WattsMin = std::min(std::min(Watts, WattsMin), b.WattsMin);
-		WattsMax = std::max(std::max(Watts, WattsMax), b.WattsMax);
-		Volts = ((Volts * Averages) + (b.Volts * b.Averages)) / (Averages + b.Averages);	// weighted average
-		VoltsMin = std::min(std::min(Volts, VoltsMin), b.VoltsMin);
-		VoltsMax = std::max(std::max(Volts, VoltsMax), b.VoltsMax);
-		Amps = ((Amps * Averages) + (b.Amps * b.Averages)) / (Averages + b.Averages);	// weighted average
-		AmpsMin = std::min(std::min(Amps, AmpsMin), b.AmpsMin);
-		AmpsMax = std::max(std::max(Amps, AmpsMax), b.AmpsMax);
-		TotalWattHours = std::max(TotalWattHours, b.TotalWattHours);
-		Averages += b.Averages; // existing average + new average
+		FakeMRTGFile.Day.Set(index, TheValue);
+		FakeMRTGFile.Day.SetTime(index, FirstTime + (Count - 1 - index) * DAY_SAMPLE);
 	}
-	return(*this);
+	// A week, month, or year sample is the average of the last 6, 24, or 288 day samples, all of which are TheValue here
+	CKASAReading WeekSample, MonthSample, YearSample;
+	for (auto index = 0; index < 6; index++)
+		WeekSample += TheValue;
+	for (auto index = 0; index < 12 * 2; index++)
+		MonthSample += TheValue;
+	for (auto index = 0; index < 12 * 24; index++)
+		YearSample += TheValue;
+	// Coarser boundaries only fall on the hour or half hour, which repeats every six day samples, so find the first one and step from there
+	size_t First = 0;
+	for (size_t index = 0; (index < std::min(Count, size_t(6))) && (First == 0); index++)
+	{
+		struct tm UTC;
+		time_t SampleTime = FirstTime + index * DAY_SAMPLE;
+		if ((0 != localtime_r(&SampleTime, &UTC)) && ((UTC.tm_min == 0) || (UTC.tm_min == 30)))
+			First = index + 1;
+	}
+	if (First > 0)
+		for (size_t index = First - 1; index < Count; index += 6)
+		{
+			CKASAReading Sample;
+			Sample.Time = FirstTime + index * DAY_SAMPLE;
+			auto Granularity = Sample.GetTimeGranularity();
+			if (Granularity == CKASAReading::granularity::year)
+			{
+				FakeMRTGFile.Year.push_front(YearSample);
+				FakeMRTGFile.Year.SetTime(0, Sample.Time);
+				FakeMRTGFile.Dirty[int(GraphType::yearly)] = true;
+			}
+			if ((Granularity == CKASAReading::granularity::year) || (Granularity == CKASAReading::granularity::month))
+			{
+				FakeMRTGFile.Month.push_front(MonthSample);
+				FakeMRTGFile.Month.SetTime(0, Sample.Time);
+				FakeMRTGFile.Dirty[int(GraphType::monthly)] = true;
+			}
+			if (Granularity != CKASAReading::granularity::day)
+			{
+				FakeMRTGFile.Week.push_front(WeekSample);
+				FakeMRTGFile.Week.SetTime(0, Sample.Time);
+				FakeMRTGFile.Dirty[int(GraphType::weekly)] = true;
+			}
+		}
 }
-/////////////////////////////////////////////////////////////////////////////
-std::map<std::string, std::vector<CKASAReading>> KasaMRTGLogs; // memory map of BT addresses and vector structure similar to MRTG Log Files
-std::map<std::string, std::string> KasaTitles;
-enum class GraphType { daily, weekly, monthly, yearly };
-void UpdateMRTGData(const std::string& TheDeviceID, CKASAReading& TheValue)
+// The map defaults to the global, but startup replay builds each device group in its own map on a worker thread.
+void UpdateMRTGData(const std::string_view TheDeviceID, CKASAReading& TheValue, std::map<std::string, CMRTGLog, std::less<>>& TheLogs = KasaMRTGLogs)
 {
-	std::vector<CKASAReading> foo;
-	auto ret = KasaMRTGLogs.insert(std::pair<std::string, std::vector<CKASAReading>>(TheDeviceID, foo));
-	std::vector<CKASAReading>& FakeMRTGFile = ret.first->second;
-	if (FakeMRTGFile.empty())
+	auto it = TheLogs.find(TheDeviceID);
+	if (it == TheLogs.end())
 	{
-		FakeMRTGFile.resize(2 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT + YEAR_COUNT);
-		FakeMRTGFile[0] = TheValue;	// current value
-		FakeMRTGFile[1] = TheValue;
+		it = TheLogs.emplace(std::string(TheDeviceID), CMRTGLog()).first;
+		CMRTGLog& FakeMRTGFile = it->second;
+		FakeMRTGFile.Current = TheValue;	// current value
+		FakeMRTGFile.Accumulator = TheValue;
+		time_t SampleTime = FakeMRTGFile.Accumulator.Time;
 		for (auto index = 0; index < DAY_COUNT; index++)
-			FakeMRTGFile[index + 2].Time = FakeMRTGFile[index + 1].Time - DAY_SAMPLE;
+			FakeMRTGFile.Day.SetTime(index, SampleTime = SampleTime - DAY_SAMPLE);
 		for (auto index = 0; index < WEEK_COUNT; index++)
-			FakeMRTGFile[index + 2 + DAY_COUNT].Time = FakeMRTGFile[index + 1 + DAY_COUNT].Time - WEEK_SAMPLE;
+			FakeMRTGFile.Week.SetTime(index, SampleTime = SampleTime - WEEK_SAMPLE);
 		for (auto index = 0; index < MONTH_COUNT; index++)
-			FakeMRTGFile[index + 2 + DAY_COUNT + WEEK_COUNT].Time = FakeMRTGFile[index + 1 + DAY_COUNT + WEEK_COUNT].Time - MONTH_SAMPLE;
+			FakeMRTGFile.Month.SetTime(index, SampleTime = SampleTime - MONTH_SAMPLE);
 		for (auto index = 0; index < YEAR_COUNT; index++)
-			FakeMRTGFile[index + 2 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT].Time = FakeMRTGFile[index + 1 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT].Time - YEAR_SAMPLE;
+			FakeMRTGFile.Year.SetTime(index, SampleTime = SampleTime - YEAR_SAMPLE);
 	}
 	else
 	{
-		FakeMRTGFile[0] = TheValue;	// current value
-		FakeMRTGFile[1] += TheValue;
+		it->second.Current = TheValue;	// current value
+		it->second.Accumulator += TheValue;
 	}
+	CMRTGLog& FakeMRTGFile = it->second;
+	FakeMRTGFile.Dirty[int(GraphType::daily)] = true;	// the daily graph always shows the current reading
+	FakeMRTGFile.Generation++;
 	bool ZeroAccumulator = false;
-	auto DaySampleFirst = FakeMRTGFile.begin() + 2;
-	auto DaySampleLast = FakeMRTGFile.begin() + 1 + DAY_COUNT;
-	auto WeekSampleFirst = FakeMRTGFile.begin() + 2 + DAY_COUNT;
-	auto WeekSampleLast = FakeMRTGFile.begin() + 1 + DAY_COUNT + WEEK_COUNT;
-	auto MonthSampleFirst = FakeMRTGFile.begin() + 2 + DAY_COUNT + WEEK_COUNT;
-	auto MonthSampleLast = FakeMRTGFile.begin() + 1 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT;
-	auto YearSampleFirst = FakeMRTGFile.begin() + 2 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT;
-	auto YearSampleLast = FakeMRTGFile.begin() + 1 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT + YEAR_COUNT;
-	// For every time difference between FakeMRTGFile[1] and FakeMRTGFile[2] that's greater than DAY_SAMPLE we shift that data towards the back.
-	while (difftime(FakeMRTGFile[1].Time, DaySampleFirst->Time) > DAY_SAMPLE)
+	size_t GapSamples = 0;
+	CMRTGTier& Day = FakeMRTGFile.Day;
+	// For every time difference between the accumulator and the newest day sample that's greater than DAY_SAMPLE we add a new day sample.
+	while (difftime(FakeMRTGFile.Accumulator.Time, Day.GetTime(0)) > DAY_SAMPLE)
 	{
 		ZeroAccumulator = true;
-		// shuffle all the day samples toward the end
-		std::copy_backward(DaySampleFirst, DaySampleLast - 1, DaySampleLast);
-		*DaySampleFirst = FakeMRTGFile[1];
-		DaySampleFirst->NormalizeTime(CKASAReading::granularity::day);
-		if (difftime(DaySampleFirst->Time, (DaySampleFirst + 1)->Time) > DAY_SAMPLE)
-			DaySampleFirst->Time = (DaySampleFirst + 1)->Time + DAY_SAMPLE;
-		if (DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::year)
+		// Once a full day of a long gap has been filled in sample by sample, the rest of the gap can be filled in one step
+		if ((GapSamples >= 12 * 24) && FakeMRTGFile.Accumulator.IsValid())
+		{
+			CKASAReading Normalized(FakeMRTGFile.Accumulator);
+			Normalized.NormalizeTime(CKASAReading::granularity::day);
+			if (Normalized.Time > Day.GetTime(0) + 3 * time_t(DAY_SAMPLE))
+				FastForwardMRTGData(FakeMRTGFile, FakeMRTGFile.Accumulator, (Normalized.Time - Day.GetTime(0)) / DAY_SAMPLE - 2);
+		}
+		GapSamples++;
+		CKASAReading Sample(FakeMRTGFile.Accumulator);
+		Sample.NormalizeTime(CKASAReading::granularity::day);
+		if (difftime(Sample.Time, Day.GetTime(0)) > DAY_SAMPLE)
+			Sample.Time = Day.GetTime(0) + DAY_SAMPLE;
+		Day.push_front(Sample);
+		const auto Granularity = Sample.GetTimeGranularity();
+		if (Granularity == CKASAReading::granularity::year)
 		{
 			if (ConsoleVerbosity > 1)
-				std::cout << "[" << getTimeISO8601() << "] shuffling year " << timeToExcelLocal(DaySampleFirst->Time) << " > " << timeToExcelLocal(YearSampleFirst->Time) << std::endl;
-			// shuffle all the year samples toward the end
-			std::copy_backward(YearSampleFirst, YearSampleLast - 1, YearSampleLast);
-			*YearSampleFirst = CKASAReading();
-			for (auto iter = DaySampleFirst; (iter->IsValid() && ((iter - DaySampleFirst) < (12 * 24))); iter++) // One Day of day samples
-				*YearSampleFirst += *iter;
+				std::cout << "[" << getTimeISO8601() << "] shuffling year " << timeToExcelLocal(Sample.Time) << " > " << timeToExcelLocal(FakeMRTGFile.Year.GetTime(0)) << std::endl;
+			FakeMRTGFile.Year.push_front(Day.Rollup(12 * 24)); // One Day of day samples
+			FakeMRTGFile.Dirty[int(GraphType::yearly)] = true;
 		}
-		if ((DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::year) ||
-			(DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::month))
+		if ((Granularity == CKASAReading::granularity::year) ||
+			(Granularity == CKASAReading::granularity::month))
 		{
 			if (ConsoleVerbosity > 1)
-				std::cout << "[" << getTimeISO8601() << "] shuffling month " << timeToExcelLocal(DaySampleFirst->Time) << std::endl;
-			// shuffle all the month samples toward the end
-			std::copy_backward(MonthSampleFirst, MonthSampleLast - 1, MonthSampleLast);
-			*MonthSampleFirst = CKASAReading();
-			for (auto iter = DaySampleFirst; (iter->IsValid() && ((iter - DaySampleFirst) < (12 * 2))); iter++) // two hours of day samples
-				*MonthSampleFirst += *iter;
+				std::cout << "[" << getTimeISO8601() << "] shuffling month " << timeToExcelLocal(Sample.Time) << std::endl;
+			FakeMRTGFile.Month.push_front(Day.Rollup(12 * 2)); // two hours of day samples
+			FakeMRTGFile.Dirty[int(GraphType::monthly)] = true;
 		}
-		if ((DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::year) ||
-			(DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::month) ||
-			(DaySampleFirst->GetTimeGranularity() == CKASAReading::granularity::week))
+		if ((Granularity == CKASAReading::granularity::year) ||
+			(Granularity == CKASAReading::granularity::month) ||
+			(Granularity == CKASAReading::granularity::week))
 		{
 			if (ConsoleVerbosity > 1)
-				std::cout << "[" << getTimeISO8601() << "] shuffling week " << timeToExcelLocal(DaySampleFirst->Time) << std::endl;
-			// shuffle all the month samples toward the end
-			std::copy_backward(WeekSampleFirst, WeekSampleLast - 1, WeekSampleLast);
-			*WeekSampleFirst = CKASAReading();
-			for (auto iter = DaySampleFirst; (iter->IsValid() && ((iter - DaySampleFirst) < 6)); iter++) // Half an hour of day samples
-				*WeekSampleFirst += *iter;
+				std::cout << "[" << getTimeISO8601() << "] shuffling week " << timeToExcelLocal(Sample.Time) << std::endl;
+			FakeMRTGFile.Week.push_front(Day.Rollup(6)); // Half an hour of day samples
+			FakeMRTGFile.Dirty[int(GraphType::weekly)] = true;
 		}
 	}
 	if (ZeroAccumulator)
-		FakeMRTGFile[1] = CKASAReading();
+		FakeMRTGFile.Accumulator = CKASAReading();
 }
-// Returns a curated vector of data points specific to the requested graph type from the internal memory structure map keyed off the Bluetooth address.
-void ReadMRTGData(const std::string& TheDeviceID, std::vector<CKASAReading>& TheValues, const GraphType graph = GraphType::daily)
+/////////////////////////////////////////////////////////////////////////////
+// Publishes the current reading and the accumulator of every device in a POSIX shared memory segment,
+// so local tools like --mrtg can read them without the log files. Only the aggregator thread writes.
+// Each entry carries a sequence number that's odd while it's being written. A reader copies the entry
+// and keeps the copy only if the sequence was even and unchanged across it, so neither side takes a lock
+// or makes a system call.
+class CLiveState {
+public:
+	CLiveState() : Segment(NULL), SegmentSize(0), bOwner(false) { };
+	~CLiveState();
+	bool Create(const std::string& TheName);	// for the daemon, starts with no devices
+	bool Attach(const std::string& TheName);	// for readers, read only
+	// The last few readings as they were logged, so --mrtg can average them the same way it averages the log file
+	struct RecentReading {
+		int64_t Time;
+		int32_t MilliWatts;
+		int32_t MilliVolts;
+		uint32_t bFloat;	// the device reported floating point units, which the log file keeps more digits of
+	};
+	static const size_t RecentCount = 16;
+	void Publish(const std::string_view TheDeviceID, const CMRTGLog& TheLog, const CKASAReading* TheReading = NULL, const bool bFloat = false);
+	// Recent, if asked for, gets the readings newest first. Every reading taken at or after RecentSince is among them.
+	bool Read(const std::string_view TheDeviceID, CKASAReading& Current, CKASAReading& Accumulator, std::vector<RecentReading>* Recent = NULL, time_t* RecentSince = NULL) const;
+protected:
+	static const uint32_t Magic = 0x4153414b;	// "KASA"
+	static const uint32_t Version = 2;	// changes whenever the layout does
+	static const uint32_t Capacity = 1024;
+	static const size_t DeviceIDSize = 64;
+	struct Header {
+		uint32_t Magic;
+		uint32_t Version;
+		uint32_t Capacity;
+		uint32_t EntrySize;
+		std::atomic<uint32_t> Count;	// entries in use, an entry is complete before it's counted
+	};
+	struct alignas(64) Entry {
+		std::atomic<uint32_t> Sequence;
+		char DeviceID[DeviceIDSize];	// never changes once the entry is counted
+		CKASAReading Current;
+		CKASAReading Accumulator;
+		int64_t RecentStart;	// time of the first reading published by this daemon
+		uint32_t RecentPublished;	// readings published, the next one goes in Recent[RecentPublished % RecentCount]
+		RecentReading Recent[RecentCount];
+	};
+	static_assert(std::is_trivially_copyable<CKASAReading>::value, "readings are copied in and out of shared memory as bytes");
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "the sequence numbers are shared between processes");
+	Header* GetHeader(void) const { return(static_cast<Header*>(Segment)); };
+	Entry* GetEntry(const size_t index) const { return(reinterpret_cast<Entry*>(static_cast<char*>(Segment) + sizeof(Entry)) + index); };
+	void* Segment;
+	size_t SegmentSize;
+	std::string Name;
+	bool bOwner;
+	std::unordered_map<std::string, size_t> Slots;	// the daemon's index of DeviceID to entry
+};
+CLiveState::~CLiveState()
 {
-	auto it = KasaMRTGLogs.find(TheDeviceID);
-	if (it != KasaMRTGLogs.end())
+	if (Segment != NULL)
+		munmap(Segment, SegmentSize);
+	if (bOwner)
+		shm_unlink(Name.c_str());	// stale readings would look live to the next reader
+}
+bool CLiveState::Create(const std::string& TheName)
+{
+	static_assert(sizeof(Header) <= sizeof(Entry), "the header fits in the space of one entry");
+	const size_t TheSize = sizeof(Entry) * (Capacity + 1);
+	shm_unlink(TheName.c_str());	// left over from a run that didn't exit cleanly
+	int SharedMemory = shm_open(TheName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (SharedMemory == -1)
+		return(false);
+	void* TheSegment = MAP_FAILED;
+	if (0 == ftruncate(SharedMemory, TheSize))
+		TheSegment = mmap(NULL, TheSize, PROT_READ | PROT_WRITE, MAP_SHARED, SharedMemory, 0);
+	close(SharedMemory);
+	if (TheSegment == MAP_FAILED)
 	{
-		if (it->second.size() > 0)
-		{
-			auto DaySampleFirst = it->second.begin() + 2;
-			auto DaySampleLast = it->second.begin() + 1 + DAY_COUNT;
-			auto WeekSampleFirst = it->second.begin() + 2 + DAY_COUNT;
-			auto WeekSampleLast = it->second.begin() + 1 + DAY_COUNT + WEEK_COUNT;
-			auto MonthSampleFirst = it->second.begin() + 2 + DAY_COUNT + WEEK_COUNT;
-			auto MonthSampleLast = it->second.begin() + 1 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT;
-			auto YearSampleFirst = it->second.begin() + 2 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT;
-			auto YearSampleLast = it->second.begin() + 1 + DAY_COUNT + WEEK_COUNT + MONTH_COUNT + YEAR_COUNT;
-			if (graph == GraphType::daily)
-			{
-				TheValues.resize(DAY_COUNT);
-				std::copy(DaySampleFirst, DaySampleLast, TheValues.begin());
-				auto iter = TheValues.begin();
-				while (iter->IsValid() && (iter != TheValues.end()))
-					iter++;
-				TheValues.resize(iter - TheValues.begin());
-				TheValues.begin()->Time = it->second.begin()->Time; //HACK: include the most recent time sample
-			}
-			else if (graph == GraphType::weekly)
-			{
-				TheValues.resize(WEEK_COUNT);
-				std::copy(WeekSampleFirst, WeekSampleLast, TheValues.begin());
-				auto iter = TheValues.begin();
-				while (iter->IsValid() && (iter != TheValues.end()))
-					iter++;
-				TheValues.resize(iter - TheValues.begin());
-			}
-			else if (graph == GraphType::monthly)
-			{
-				TheValues.resize(MONTH_COUNT);
-				std::copy(MonthSampleFirst, MonthSampleLast, TheValues.begin());
-				auto iter = TheValues.begin();
-				while (iter->IsValid() && (iter != TheValues.end()))
-					iter++;
-				TheValues.resize(iter - TheValues.begin());
-			}
-			else if (graph == GraphType::yearly)
-			{
-				TheValues.resize(YEAR_COUNT);
-				std::copy(YearSampleFirst, YearSampleLast, TheValues.begin());
-				auto iter = TheValues.begin();
-				while (iter->IsValid() && (iter != TheValues.end()))
-					iter++;
-				TheValues.resize(iter - TheValues.begin());
-			}
-		}
+		shm_unlink(TheName.c_str());
+		return(false);
+	}
+	Segment = TheSegment;
+	SegmentSize = TheSize;
+	Name = TheName;
+	bOwner = true;
+	Header* TheHeader = new (Segment) Header;
+	TheHeader->Capacity = Capacity;
+	TheHeader->EntrySize = sizeof(Entry);
+	TheHeader->Count.store(0);
+	TheHeader->Version = Version;
+	std::atomic_thread_fence(std::memory_order_release);
+	TheHeader->Magic = Magic;	// readers ignore the segment until this is set
+	return(true);
+}
+bool CLiveState::Attach(const std::string& TheName)
+{
+	int SharedMemory = shm_open(TheName.c_str(), O_RDONLY | O_CLOEXEC, 0);
+	if (SharedMemory == -1)
+		return(false);
+	struct stat SharedMemoryStat;
+	void* TheSegment = MAP_FAILED;
+	if ((0 == fstat(SharedMemory, &SharedMemoryStat)) && (SharedMemoryStat.st_size >= off_t(sizeof(Entry))))
+		TheSegment = mmap(NULL, SharedMemoryStat.st_size, PROT_READ, MAP_SHARED, SharedMemory, 0);
+	close(SharedMemory);
+	if (TheSegment == MAP_FAILED)
+		return(false);
+	Segment = TheSegment;
+	SegmentSize = SharedMemoryStat.st_size;
+	const Header* TheHeader = GetHeader();
+	if ((TheHeader->Magic != Magic) || (TheHeader->Version != Version) || (TheHeader->EntrySize != sizeof(Entry)) || (SegmentSize < sizeof(Entry) * (size_t(TheHeader->Capacity) + 1)))
+	{
+		munmap(Segment, SegmentSize);
+		Segment = NULL;
+		return(false);
 	}
+	return(true);
 }
-// Interesting ideas about SVG and possible tools to look at: https://blog.usejournal.com/of-svg-minification-and-gzip-21cd26a5d007
-// Tools Mentioned: svgo gzthermal https://github.com/subzey/svg-gz-supplement/
-// Takes a curated vector of data points for a specific graph type and writes a SVG file to disk.
-void WriteSVG(std::vector<CKASAReading>& TheValues, const std::string& SVGFileName, const std::string& Title = "", const GraphType graph = GraphType::daily, const bool MinMax = false, const bool DrawTotalWH = false)
-{
-	// By declaring these items here, I'm then basing all my other dimensions on these
-	const int SVGWidth = 500;
-	const int SVGHeight = 135;
-	const int FontSize = 12;
-	const int TickSize = 2;
-	int GraphWidth = SVGWidth - (FontSize * 8);
-	if (DrawTotalWH)
-		GraphWidth -= FontSize;
-	if (!TheValues.empty())
+void CLiveState::Publish(const std::string_view TheDeviceID, const CMRTGLog& TheLog, const CKASAReading* TheReading, const bool bFloat)
+{
+	if ((Segment == NULL) || !bOwner)
+		return;
+	Header* TheHeader = GetHeader();
+	auto Slot = Slots.find(std::string(TheDeviceID));
+	const bool bNew = (Slot == Slots.end());
+	if (bNew)
 	{
-		struct stat64 SVGStat;
-		SVGStat.st_mtim.tv_sec = 0;
-		if (-1 == stat64(SVGFileName.c_str(), &SVGStat))
-			if (ConsoleVerbosity > 0)
-				perror(SVGFileName.c_str());
-		//std::cout << "[" << getTimeISO8601() << "] stat returned error on : " << SVGFileName << std::endl;
-		if (TheValues.begin()->Time > SVGStat.st_mtim.tv_sec)	// only write the file if we have new data
+		if ((Slots.size() >= Capacity) || (TheDeviceID.size() >= DeviceIDSize))
+			return;
+		Slot = Slots.emplace(std::string(TheDeviceID), Slots.size()).first;
+	}
+	Entry* TheEntry = GetEntry(Slot->second);
+	const uint32_t Sequence = TheEntry->Sequence.load(std::memory_order_relaxed);
+	TheEntry->Sequence.store(Sequence + 1, std::memory_order_relaxed);	// odd, being written
+	std::atomic_thread_fence(std::memory_order_release);
+	if (bNew)
+	{
+		memset(TheEntry->DeviceID, 0, sizeof(TheEntry->DeviceID));
+		memcpy(TheEntry->DeviceID, TheDeviceID.data(), TheDeviceID.size());
+		TheEntry->RecentPublished = 0;
+	}
+	TheEntry->Current = TheLog.Current;
+	TheEntry->Accumulator = TheLog.Accumulator;
+	if (TheReading != NULL)
+	{
+		if (TheEntry->RecentPublished == 0)
+			TheEntry->RecentStart = TheReading->Time;
+		RecentReading& TheRecent = TheEntry->Recent[TheEntry->RecentPublished++ % RecentCount];
+		TheRecent.Time = TheReading->Time;
+		TheRecent.MilliWatts = int32_t(std::llround(TheReading->GetWatts() * 1000.0));
+		TheRecent.MilliVolts = int32_t(std::llround(TheReading->GetVolts() * 1000.0));
+		TheRecent.bFloat = bFloat;
+	}
+	TheEntry->Sequence.store(Sequence + 2, std::memory_order_release);	// even again, complete
+	if (bNew)
+		TheHeader->Count.store(uint32_t(Slots.size()), std::memory_order_release);
+}
+bool CLiveState::Read(const std::string_view TheDeviceID, CKASAReading& Current, CKASAReading& Accumulator, std::vector<RecentReading>* Recent, time_t* RecentSince) const
+{
+	if (Segment == NULL)
+		return(false);
+	const Header* TheHeader = GetHeader();
+	const size_t Count = std::min(TheHeader->Count.load(std::memory_order_acquire), TheHeader->Capacity);
+	for (size_t index = 0; index < Count; index++)
+	{
+		const Entry* TheEntry = GetEntry(index);
+		if ((TheDeviceID.size() < DeviceIDSize) && (0 == memcmp(TheEntry->DeviceID, TheDeviceID.data(), TheDeviceID.size())) && (TheEntry->DeviceID[TheDeviceID.size()] == '\0'))
 		{
-			std::ofstream SVGFile(SVGFileName);
-			if (SVGFile.is_open())
+			for (auto Attempt = 0; Attempt < 1000; Attempt++)	// a daemon killed part way through a write leaves the entry odd for good
 			{
-				if (ConsoleVerbosity > 0)
-					std::cout << "[" << getTimeISO8601() << "] Writing: " << SVGFileName << " With Title: " << Title << std::endl;
-				else
-					std::cerr << "Writing: " << SVGFileName << " With Title: " << Title << std::endl;
-				std::ostringstream tempOString;
-				tempOString << "Watts (" << std::setprecision(2) << TheValues[0].GetWatts() << ")";
-				std::string YLegendWatts(tempOString.str());
-				tempOString = std::ostringstream();
-				tempOString << "Amps (" << std::setprecision(2) << TheValues[0].GetAmps() << ")";
-				std::string YLegendAmps(tempOString.str());
-				double TotalWHMin = DBL_MAX;
-				double TotalWHMax = DBL_MIN;
-				for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-				{
-					TotalWHMin = std::min(TotalWHMin, TheValues[index].GetTotalWattHours());
-					TotalWHMax = std::max(TotalWHMax, TheValues[index].GetTotalWattHours());
-				}
-				if ((TotalWHMax - TotalWHMin) < 1)
-					TotalWHMax = TotalWHMin + 1;
-				tempOString = std::ostringstream();
-				tempOString << "Total WH (" << TotalWHMin << " - " << TotalWHMax << ")";
-				std::string YLegendTotalWH(tempOString.str());
-				int GraphTop = FontSize + TickSize;
-				int GraphBottom = SVGHeight - GraphTop;
-				int GraphRight = SVGWidth - (GraphTop * 2) - 2;
-				int GraphLeft = GraphRight - GraphWidth;
-				int GraphVerticalDivision = (GraphBottom - GraphTop) / 4;
-				double WattsMin = 0;
-				double WattsMax = DBL_MIN;
-				double AmpsMin = 0;
-				double AmpsMax = DBL_MIN;
-				if (MinMax)
-					for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-					{
-						WattsMax = std::max(WattsMax, TheValues[index].GetWattsMax());
-						AmpsMax = std::max(AmpsMax, TheValues[index].GetAmpsMax());
-					}
-				else
-					for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-					{
-						WattsMax = std::max(WattsMax, TheValues[index].GetWatts());
-						AmpsMax = std::max(AmpsMax, TheValues[index].GetAmps());
-					}
-				// These next two checks are to make sure the virtical factor doesn't skyrocket to rediculous proportions.
-				if ((WattsMax - WattsMin) < 1)
-					WattsMax = WattsMin + 1;
-				if ((AmpsMax - AmpsMin) < 0.001)
-					AmpsMax = AmpsMin + 0.001;
-
-				double WattsVerticalDivision = (WattsMax - WattsMin) / 4;
-				double WattsVerticalFactor = (GraphBottom - GraphTop) / (WattsMax - WattsMin);
-				double AmpsVerticalDivision = (AmpsMax - AmpsMin) / 4;
-				double AmpsVerticalFactor = (GraphBottom - GraphTop) / (AmpsMax - AmpsMin);
-
-				SVGFile << "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>" << std::endl;
-				SVGFile << "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"" << SVGWidth << "\" height=\"" << SVGHeight << "\">" << std::endl;
-				SVGFile << "\t<!-- Created by: " << ProgramVersionString << " -->" << std::endl;
-				SVGFile << "\t<style>" << std::endl;
-				SVGFile << "\t\ttext { font-family: sans-serif; font-size: " << FontSize << "px; fill: black; }" << std::endl;
-				SVGFile << "\t\tline { stroke: black; }" << std::endl;
-				SVGFile << "\t\tpolygon { fill-opacity: 0.5; }" << std::endl;
-				SVGFile << "\t@media only screen and (prefers-color-scheme: dark) {" << std::endl;
-				SVGFile << "\t\ttext { fill: grey; }" << std::endl;
-				SVGFile << "\t\tline { stroke: grey; }" << std::endl;
-				SVGFile << "\t}" << std::endl;
-				SVGFile << "\t</style>" << std::endl;
-				SVGFile << "\t<rect style=\"fill-opacity:0;stroke:grey;stroke-width:2\" width=\"" << SVGWidth << "\" height=\"" << SVGHeight << "\" />" << std::endl;
-
-				// Legend Text
-				SVGFile << "\t<text x=\"" << GraphLeft << "\" y=\"" << GraphTop - 2 << "\">" << Title << "</text>" << std::endl;
-				SVGFile << "\t<text style=\"text-anchor:end\" x=\"" << GraphRight << "\" y=\"" << GraphTop - 2 << "\">" << timeToExcelLocal(TheValues[0].Time) << "</text>" << std::endl;
-				SVGFile << "\t<text style=\"fill:blue;text-anchor:middle\" x=\"" << FontSize << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize << "," << (GraphTop + GraphBottom) / 2 << ")\">" << YLegendAmps << "</text>" << std::endl;
-				SVGFile << "\t<text style=\"fill:green;text-anchor:middle\" x=\"" << FontSize * 2 << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize * 2 << "," << (GraphTop + GraphBottom) / 2 << ")\">" << YLegendWatts << "</text>" << std::endl;
-				if (DrawTotalWH)
-					SVGFile << "\t<text style=\"fill:OrangeRed\" text-anchor=\"middle\" x=\"" << FontSize * 3 << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize * 3 << "," << (GraphTop + GraphBottom) / 2 << ")\">" << YLegendTotalWH << "</text>" << std::endl;
-
-				if (MinMax)
-				{
-					SVGFile << "\t<!-- Watts Max -->" << std::endl;
-					SVGFile << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
-					SVGFile << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
-					for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWattsMax()) * WattsVerticalFactor) + GraphTop) << " ";
-					if (GraphWidth < TheValues.size())
-						SVGFile << GraphRight - 1 << "," << GraphBottom - 1;
-					else
-						SVGFile << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
-					SVGFile << "\" />" << std::endl;
-					SVGFile << "\t<!-- Watts Min -->" << std::endl;
-					SVGFile << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
-					SVGFile << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
-					for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWattsMin()) * WattsVerticalFactor) + GraphTop) << " ";
-					if (GraphWidth < TheValues.size())
-						SVGFile << GraphRight - 1 << "," << GraphBottom - 1;
-					else
-						SVGFile << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
-					SVGFile << "\" />" << std::endl;
-				}
-				else
-				{
-					// Watts Graphic as a Filled polygon
-					SVGFile << "\t<!-- Watts -->" << std::endl;
-					SVGFile << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
-					SVGFile << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
-					for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWatts()) * WattsVerticalFactor) + GraphTop) << " ";
-					if (GraphWidth < TheValues.size())
-						SVGFile << GraphRight - 1 << "," << GraphBottom - 1;
-					else
-						SVGFile << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
-					SVGFile << "\" />" << std::endl;
-				}
-
-				// Top Line
-				SVGFile << "\t<line x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphTop << "\"/>" << std::endl;
-				SVGFile << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphTop + 5 << "\">" << std::setprecision(2) << AmpsMax << "</text>" << std::endl;
-				SVGFile << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphTop + 4 << "\">" << std::setprecision(2) << WattsMax << "</text>" << std::endl;
-
-				// Bottom Line
-				SVGFile << "\t<line x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphBottom << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphBottom << "\"/>" << std::endl;
-				SVGFile << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphBottom + 5 << "\">" << std::setprecision(2) << AmpsMin << "</text>" << std::endl;
-				SVGFile << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphBottom + 4 << "\">" << std::setprecision(2) << WattsMin << "</text>" << std::endl;
-
-				// Left Line
-				SVGFile << "\t<line x1=\"" << GraphLeft << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft << "\" y2=\"" << GraphBottom << "\"/>" << std::endl;
-
-				// Right Line
-				SVGFile << "\t<line x1=\"" << GraphRight << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphRight << "\" y2=\"" << GraphBottom << "\"/>" << std::endl;
-
-				// Vertical Division Dashed Lines
-				for (auto index = 1; index < 4; index++)
-				{
-					SVGFile << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphTop + (GraphVerticalDivision * index) << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphTop + (GraphVerticalDivision * index) << "\" />" << std::endl;
-					SVGFile << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphTop + 4 + (GraphVerticalDivision * index) << "\">" << std::setprecision(2) << AmpsMax - (AmpsVerticalDivision * index) << "</text>" << std::endl;
-					SVGFile << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphTop + 4 + (GraphVerticalDivision * index) << "\">" << std::setprecision(2) << WattsMax - (WattsVerticalDivision * index) << "</text>" << std::endl;
-				}
-
-				// Horizontal Division Dashed Lines
-				for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				const uint32_t Before = TheEntry->Sequence.load(std::memory_order_acquire);
+				if (Before & 1)
+					continue;	// the daemon is part way through writing it
+				memcpy((void *)&Current, &TheEntry->Current, sizeof(Current));
+				memcpy((void *)&Accumulator, &TheEntry->Accumulator, sizeof(Accumulator));
+				int64_t RecentStart;
+				uint32_t RecentPublished;
+				RecentReading TheRecent[RecentCount];
+				memcpy(&RecentStart, &TheEntry->RecentStart, sizeof(RecentStart));
+				memcpy(&RecentPublished, &TheEntry->RecentPublished, sizeof(RecentPublished));
+				memcpy(TheRecent, TheEntry->Recent, sizeof(TheRecent));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (Before == TheEntry->Sequence.load(std::memory_order_relaxed))
 				{
-					struct tm UTC;
-					if (0 != localtime_r(&TheValues[index].Time, &UTC))
+					if (Recent != NULL)
 					{
-						if (graph == GraphType::daily)
-						{
-							if (UTC.tm_min == 0)
-							{
-								if (UTC.tm_hour == 0)
-									SVGFile << "\t<line style=\"stroke:red\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-								else
-									SVGFile << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-								if (UTC.tm_hour % 2 == 0)
-									SVGFile << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << UTC.tm_hour << "</text>" << std::endl;
-							}
-						}
-						else if (graph == GraphType::weekly)
-						{
-							const std::string Weekday[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-							if ((UTC.tm_hour == 0) && (UTC.tm_min == 0))
-							{
-								if (UTC.tm_wday == 1)
-									SVGFile << "\t<line style=\"stroke:red\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-								else
-									SVGFile << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-							}
-							else if ((UTC.tm_hour == 12) && (UTC.tm_min == 0))
-								SVGFile << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << Weekday[UTC.tm_wday] << "</text>" << std::endl;
-						}
-						else if (graph == GraphType::monthly)
-						{
-							if ((UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
-								SVGFile << "\t<line style=\"stroke:red\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-							if ((UTC.tm_wday == 0) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
-								SVGFile << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-							else if ((UTC.tm_wday == 3) && (UTC.tm_hour == 12) && (UTC.tm_min == 0))
-								SVGFile << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">Week " << UTC.tm_yday / 7 + 1 << "</text>" << std::endl;
-						}
-						else if (graph == GraphType::yearly)
-						{
-							const std::string Month[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-							if ((UTC.tm_yday == 0) && (UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
-								SVGFile << "\t<line style=\"stroke:red\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-							else if ((UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
-								SVGFile << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << std::endl;
-							else if ((UTC.tm_mday == 15) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
-								SVGFile << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << Month[UTC.tm_mon] << "</text>" << std::endl;
-						}
+						Recent->clear();
+						for (uint32_t index = RecentPublished; (index > 0) && (RecentPublished - index < RecentCount); index--)
+							Recent->push_back(TheRecent[(index - 1) % RecentCount]);
 					}
+					if (RecentSince != NULL)	// once readings have been overwritten, only those newer than the oldest left are all there
+						*RecentSince = (RecentPublished == 0) ? std::numeric_limits<time_t>::max() : time_t((RecentPublished <= RecentCount) ? RecentStart : TheRecent[RecentPublished % RecentCount].Time + 1);
+					return(true);
 				}
-
-				// Directional Arrow
-				SVGFile << "\t<polygon style=\"fill:red;stroke:red;fill-opacity:1;\" points=\"" << GraphLeft - 3 << "," << GraphBottom << " " << GraphLeft + 3 << "," << GraphBottom - 3 << " " << GraphLeft + 3 << "," << GraphBottom + 3 << "\" />" << std::endl;
-
-				if (MinMax)
-				{
-					// Amps Values as a filled polygon showing the minimum and maximum
-					SVGFile << "\t<!-- Amps MinMax -->" << std::endl;
-					SVGFile << "\t<polygon style=\"fill:blue;stroke:blue\" points=\"";
-					for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmpsMax()) * AmpsVerticalFactor) + GraphTop) << " ";
-					for (auto index = (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()) - 1; index > 0; index--)
-						SVGFile << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmpsMin()) * AmpsVerticalFactor) + GraphTop) << " ";
-					SVGFile << "\" />" << std::endl;
-				}
-				else
-				{
-					// Amps Values as a continuous line
-					SVGFile << "\t<!-- Amps -->" << std::endl;
-					SVGFile << "\t<polyline style=\"fill:none;stroke:blue\" points=\"";
-					for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmps()) * AmpsVerticalFactor) + GraphTop) << " ";
-					SVGFile << "\" />" << std::endl;
-				}
-
-				// Total Watt-Hour Values as a continuous line
-				if (DrawTotalWH)
-				{
-					SVGFile << "\t<!-- TotalWH -->" << std::endl;
-					double TotalWHVerticalFactor = (GraphBottom - GraphTop) / (TotalWHMax - TotalWHMin);
-					SVGFile << "\t<polyline style=\"fill:none;stroke:OrangeRed\" points=\"";
-					for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
-						SVGFile << index + GraphLeft << "," << int(((TotalWHMax - TheValues[index].GetTotalWattHours()) * TotalWHVerticalFactor) + GraphTop) << " ";
-					SVGFile << "\" />" << std::endl;
-				}
-
-				SVGFile << "</svg>" << std::endl;
-				SVGFile.close();
-				struct utimbuf SVGut;
-				SVGut.actime = TheValues.begin()->Time;
-				SVGut.modtime = TheValues.begin()->Time;
-				utime(SVGFileName.c_str(), &SVGut);
 			}
+			return(false);
 		}
 	}
+	return(false);
 }
-void WriteAllSVG()
+std::string LiveStateName("/kasaenergylogger");	// If this is empty, live readings aren't published or looked for
+CLiveState LiveState;
+/////////////////////////////////////////////////////////////////////////////
+// Copies the valid samples of a tier, newest first.
+void ReadMRTGTier(const CMRTGTier& TheTier, std::vector<CKASAReading>& TheValues)
 {
-#ifdef DEBUG
-	std::ofstream IndexFile;
-	std::ostringstream IndexFilename;
-	IndexFilename << SVGDirectory;
-	IndexFilename << "index.html";
-	IndexFile.open(IndexFilename.str());
-	if (IndexFile.is_open())
-	{
-		IndexFile << "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">" << std::endl;
+	TheValues.clear();
+	TheValues.reserve(TheTier.size());
+	for (size_t index = 0; (index < TheTier.size()) && TheTier.IsValid(index); index++)
+		TheValues.push_back(TheTier.Get(index));
+}
+// Returns a curated vector of data points specific to the requested graph type from the internal memory structure map keyed off the deviceId.
+void ReadMRTGData(const std::string& TheDeviceID, std::vector<CKASAReading>& TheValues, const GraphType graph = GraphType::daily)
+{
+	auto it = KasaMRTGLogs.find(TheDeviceID);
+	if (it != KasaMRTGLogs.end())
+	{
+		if (graph == GraphType::daily)
+		{
+			ReadMRTGTier(it->second.Day, TheValues);
+			if (!TheValues.empty())
+				TheValues.begin()->Time = it->second.Current.Time; //HACK: include the most recent time sample
+		}
+		else if (graph == GraphType::weekly)
+			ReadMRTGTier(it->second.Week, TheValues);
+		else if (graph == GraphType::monthly)
+			ReadMRTGTier(it->second.Month, TheValues);
+		else if (graph == GraphType::yearly)
+			ReadMRTGTier(it->second.Year, TheValues);
+	}
+}
+// The parts of a graph that only depend on its layout: the header, the frame, the grid lines, and every
+// possible time tick. They're the same for every device, so each layout is built once and shared.
+class CSVGChrome {
+public:
+	CSVGChrome(const bool DrawTotalWH);
+	static const int SVGWidth = 500;
+	static const int SVGHeight = 135;
+	static const int FontSize = 12;
+	static const int TickSize = 2;
+	int GraphWidth;
+	int GraphTop;
+	int GraphBottom;
+	int GraphRight;
+	int GraphLeft;
+	int GraphVerticalDivision;
+	std::string Header;	// Everything up to the legend text
+	std::string TopLine;
+	std::string BottomLine;
+	std::string SideLines;
+	std::string DivisionLines[4];	// Dashed horizontal lines 1 to 3
+	std::string Arrow;
+	std::vector<std::string> RedTicks;	// Vertical lines at each sample position
+	std::vector<std::string> DashedTicks;
+};
+CSVGChrome::CSVGChrome(const bool DrawTotalWH)
+{
+	GraphWidth = SVGWidth - (FontSize * 8);
+	if (DrawTotalWH)
+		GraphWidth -= FontSize;
+	GraphTop = FontSize + TickSize;
+	GraphBottom = SVGHeight - GraphTop;
+	GraphRight = SVGWidth - (GraphTop * 2) - 2;
+	GraphLeft = GraphRight - GraphWidth;
+	GraphVerticalDivision = (GraphBottom - GraphTop) / 4;
+	std::ostringstream Text;
+	Text << "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>" << "\n";
+	Text << "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"" << SVGWidth << "\" height=\"" << SVGHeight << "\">" << "\n";
+	Text << "\t<!-- Created by: " << ProgramVersionString << " -->" << "\n";
+	Text << "\t<style>" << "\n";
+	Text << "\t\ttext { font-family: sans-serif; font-size: " << FontSize << "px; fill: black; }" << "\n";
+	Text << "\t\tline { stroke: black; }" << "\n";
+	Text << "\t\tpolygon { fill-opacity: 0.5; }" << "\n";
+	Text << "\t@media only screen and (prefers-color-scheme: dark) {" << "\n";
+	Text << "\t\ttext { fill: grey; }" << "\n";
+	Text << "\t\tline { stroke: grey; }" << "\n";
+	Text << "\t}" << "\n";
+	Text << "\t</style>" << "\n";
+	Text << "\t<rect style=\"fill-opacity:0;stroke:grey;stroke-width:2\" width=\"" << SVGWidth << "\" height=\"" << SVGHeight << "\" />" << "\n";
+	Header = Text.str();
+	Text = std::ostringstream();
+	Text << "\t<line x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphTop << "\"/>" << "\n";
+	TopLine = Text.str();
+	Text = std::ostringstream();
+	Text << "\t<line x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphBottom << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphBottom << "\"/>" << "\n";
+	BottomLine = Text.str();
+	Text = std::ostringstream();
+	Text << "\t<line x1=\"" << GraphLeft << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft << "\" y2=\"" << GraphBottom << "\"/>" << "\n";
+	Text << "\t<line x1=\"" << GraphRight << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphRight << "\" y2=\"" << GraphBottom << "\"/>" << "\n";
+	SideLines = Text.str();
+	for (auto index = 1; index < 4; index++)
+	{
+		Text = std::ostringstream();
+		Text << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft - TickSize << "\" y1=\"" << GraphTop + (GraphVerticalDivision * index) << "\" x2=\"" << GraphRight + TickSize << "\" y2=\"" << GraphTop + (GraphVerticalDivision * index) << "\" />" << "\n";
+		DivisionLines[index] = Text.str();
+	}
+	Text = std::ostringstream();
+	Text << "\t<polygon style=\"fill:red;stroke:red;fill-opacity:1;\" points=\"" << GraphLeft - 3 << "," << GraphBottom << " " << GraphLeft + 3 << "," << GraphBottom - 3 << " " << GraphLeft + 3 << "," << GraphBottom + 3 << "\" />" << "\n";
+	Arrow = Text.str();
+	for (auto index = 0; index < GraphWidth; index++)
+	{
+		Text = std::ostringstream();
+		Text << "\t<line style=\"stroke:red\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << "\n";
+		RedTicks.push_back(Text.str());
+		Text = std::ostringstream();
+		Text << "\t<line style=\"stroke-dasharray:1\" x1=\"" << GraphLeft + index << "\" y1=\"" << GraphTop << "\" x2=\"" << GraphLeft + index << "\" y2=\"" << GraphBottom + TickSize << "\" />" << "\n";
+		DashedTicks.push_back(Text.str());
+	}
+}
+const CSVGChrome& GetSVGChrome(const bool DrawTotalWH)
+{
+	static const CSVGChrome Chrome[2] = { CSVGChrome(false), CSVGChrome(true) };
+	return(Chrome[DrawTotalWH ? 1 : 0]);
+}
+// Builds an SVG document in a reusable buffer so the file can be written with a single write().
+// Numbers are formatted with to_chars exactly as an ostream with default flags would have, which
+// keeps the output the same as when it was streamed to the file.
+class CSVGWriter {
+public:
+	struct General { double Value; int Precision; };	// the same as << std::setprecision(Precision) << Value
+	CSVGWriter(std::string& TheBuffer) : Buffer(TheBuffer) { Buffer.clear(); if (Buffer.capacity() < 64 * 1024) Buffer.reserve(64 * 1024); };
+	CSVGWriter& operator<<(const std::string_view Text) { Buffer.append(Text); return(*this); };
+	CSVGWriter& operator<<(const char Character) { Buffer.push_back(Character); return(*this); };
+	CSVGWriter& operator<<(const int Value) { return(Integer(Value)); };
+	CSVGWriter& operator<<(const size_t Value) { return(Integer(Value)); };
+	CSVGWriter& operator<<(const long long Value) { return(Integer(Value)); };
+	CSVGWriter& operator<<(const unsigned long long Value) { return(Integer(Value)); };
+	CSVGWriter& operator<<(const General Number);
+	bool Write(const int FileDescriptor) const;
+	bool WriteGzip(const int FileDescriptor) const;	// the same document as a gzip stream, for web servers that serve precompressed files
+protected:
+	template <typename T>
+	CSVGWriter& Integer(const T Value);
+	static bool WriteBytes(const int FileDescriptor, const std::string_view Bytes);
+	std::string& Buffer;
+};
+template <typename T>
+CSVGWriter& CSVGWriter::Integer(const T Value)
+{
+	char Text[24];
+	auto [ptr, ec] = std::to_chars(Text, Text + sizeof(Text), Value);
+	Buffer.append(Text, ptr - Text);
+	return(*this);
+}
+CSVGWriter& CSVGWriter::operator<<(const General Number)
+{
+	char Text[32];
+	auto [ptr, ec] = std::to_chars(Text, Text + sizeof(Text), Number.Value, std::chars_format::general, Number.Precision);
+	Buffer.append(Text, ptr - Text);
+	return(*this);
+}
+bool CSVGWriter::WriteBytes(const int FileDescriptor, const std::string_view Bytes)
+{
+	size_t Written = 0;
+	while (Written < Bytes.size())
+	{
+		ssize_t nRet = write(FileDescriptor, Bytes.data() + Written, Bytes.size() - Written);
+		if (nRet > 0)
+			Written += nRet;
+		else if ((nRet == -1) && (errno == EINTR))
+			continue;
+		else
+			return(false);
+	}
+	return(true);
+}
+bool CSVGWriter::Write(const int FileDescriptor) const
+{
+	return(WriteBytes(FileDescriptor, Buffer));
+}
+bool CSVGWriter::WriteGzip(const int FileDescriptor) const
+{
+	z_stream Stream;
+	memset(&Stream, 0, sizeof(Stream));
+	// 15 + 16 asks zlib for a gzip header and trailer instead of a raw zlib stream
+	if (Z_OK != deflateInit2(&Stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY))
+		return(false);
+	thread_local std::string Compressed;	// kept between calls like the document buffer
+	Compressed.resize(deflateBound(&Stream, Buffer.size()));
+	Stream.next_in = (Bytef *)Buffer.data();
+	Stream.avail_in = Buffer.size();
+	Stream.next_out = (Bytef *)Compressed.data();
+	Stream.avail_out = Compressed.size();
+	int nRet = deflate(&Stream, Z_FINISH);	// the bound guarantees it all fits in one call
+	size_t CompressedSize = Stream.total_out;
+	deflateEnd(&Stream);
+	if (nRet != Z_STREAM_END)
+		return(false);
+	return(WriteBytes(FileDescriptor, std::string_view(Compressed.data(), CompressedSize)));
+}
+// Files are written under a temporary name beside the real one and renamed over it, so a web server
+// reading the graph sees either the previous file or the new one complete, never a partial write.
+bool ReplaceFile(const std::string& FileName, const CSVGWriter& SVG, const bool Compressed, const time_t ModificationTime)
+{
+	const std::string TempFileName(FileName + ".tmp");
+	int TempFile = open(TempFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (TempFile == -1)
+		return(false);
+	bool bWritten = Compressed ? SVG.WriteGzip(TempFile) : SVG.Write(TempFile);
+	if (0 != close(TempFile))
+		bWritten = false;
+	if (bWritten)
+	{
+		struct utimbuf TempFileTime;
+		TempFileTime.actime = ModificationTime;
+		TempFileTime.modtime = ModificationTime;
+		utime(TempFileName.c_str(), &TempFileTime);
+		bWritten = (0 == rename(TempFileName.c_str(), FileName.c_str()));
+	}
+	if (!bWritten)
+		unlink(TempFileName.c_str());
+	return(bWritten);
+}
+// Interesting ideas about SVG and possible tools to look at: https://blog.usejournal.com/of-svg-minification-and-gzip-21cd26a5d007
+// Tools Mentioned: svgo gzthermal https://github.com/subzey/svg-gz-supplement/
+// Takes a curated vector of data points for a specific graph type and builds the SVG document in SVG.
+// Returns false if there's nothing to draw.
+bool BuildSVG(CSVGWriter& SVG, std::vector<CKASAReading>& TheValues, const std::string& Title = "", const GraphType graph = GraphType::daily, const bool MinMax = false, const bool DrawTotalWH = false)
+{
+	bool rval = false;
+	// The layout comes from the shared chrome, so the graph always lines up with the frame and ticks drawn from it
+	const CSVGChrome& Chrome = GetSVGChrome(DrawTotalWH);
+	const int SVGHeight = Chrome.SVGHeight;
+	const int FontSize = Chrome.FontSize;
+	const int TickSize = Chrome.TickSize;
+	const int GraphWidth = Chrome.GraphWidth;
+	const int GraphVerticalDivision = Chrome.GraphVerticalDivision;
+	if (!TheValues.empty())
+	{
+		double TotalWHMin = DBL_MAX;
+		double TotalWHMax = DBL_MIN;
+		for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+		{
+			TotalWHMin = std::min(TotalWHMin, TheValues[index].GetTotalWattHours());
+			TotalWHMax = std::max(TotalWHMax, TheValues[index].GetTotalWattHours());
+		}
+		if ((TotalWHMax - TotalWHMin) < 1)
+			TotalWHMax = TotalWHMin + 1;
+		const int GraphTop = Chrome.GraphTop;
+		const int GraphBottom = Chrome.GraphBottom;
+		const int GraphRight = Chrome.GraphRight;
+		const int GraphLeft = Chrome.GraphLeft;
+		double WattsMin = 0;
+		double WattsMax = DBL_MIN;
+		double AmpsMin = 0;
+		double AmpsMax = DBL_MIN;
+		if (MinMax)
+			for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+			{
+				WattsMax = std::max(WattsMax, TheValues[index].GetWattsMax());
+				AmpsMax = std::max(AmpsMax, TheValues[index].GetAmpsMax());
+			}
+		else
+			for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+			{
+				WattsMax = std::max(WattsMax, TheValues[index].GetWatts());
+				AmpsMax = std::max(AmpsMax, TheValues[index].GetAmps());
+			}
+		// These next two checks are to make sure the virtical factor doesn't skyrocket to rediculous proportions.
+		if ((WattsMax - WattsMin) < 1)
+			WattsMax = WattsMin + 1;
+		if ((AmpsMax - AmpsMin) < 0.001)
+			AmpsMax = AmpsMin + 0.001;
+
+		double WattsVerticalDivision = (WattsMax - WattsMin) / 4;
+		double WattsVerticalFactor = (GraphBottom - GraphTop) / (WattsMax - WattsMin);
+		double AmpsVerticalDivision = (AmpsMax - AmpsMin) / 4;
+		double AmpsVerticalFactor = (GraphBottom - GraphTop) / (AmpsMax - AmpsMin);
+
+		SVG << Chrome.Header;
+
+		// Legend Text
+		SVG << "\t<text x=\"" << GraphLeft << "\" y=\"" << GraphTop - 2 << "\">" << Title << "</text>" << '\n';
+		SVG << "\t<text style=\"text-anchor:end\" x=\"" << GraphRight << "\" y=\"" << GraphTop - 2 << "\">" << timeToExcelLocal(TheValues[0].Time) << "</text>" << '\n';
+		SVG << "\t<text style=\"fill:blue;text-anchor:middle\" x=\"" << FontSize << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize << "," << (GraphTop + GraphBottom) / 2 << ")\">" << "Amps (" << CSVGWriter::General{ TheValues[0].GetAmps(), 2 } << ")" << "</text>" << '\n';
+		SVG << "\t<text style=\"fill:green;text-anchor:middle\" x=\"" << FontSize * 2 << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize * 2 << "," << (GraphTop + GraphBottom) / 2 << ")\">" << "Watts (" << CSVGWriter::General{ TheValues[0].GetWatts(), 2 } << ")" << "</text>" << '\n';
+		if (DrawTotalWH)
+			SVG << "\t<text style=\"fill:OrangeRed\" text-anchor=\"middle\" x=\"" << FontSize * 3 << "\" y=\"" << (GraphTop + GraphBottom) / 2 << "\" transform=\"rotate(270 " << FontSize * 3 << "," << (GraphTop + GraphBottom) / 2 << ")\">" << "Total WH (" << CSVGWriter::General{ TotalWHMin, 6 } << " - " << CSVGWriter::General{ TotalWHMax, 6 } << ")" << "</text>" << '\n';
+
+		if (MinMax)
+		{
+			SVG << "\t<!-- Watts Max -->" << '\n';
+			SVG << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
+			SVG << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
+			for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWattsMax()) * WattsVerticalFactor) + GraphTop) << " ";
+			if (GraphWidth < TheValues.size())
+				SVG << GraphRight - 1 << "," << GraphBottom - 1;
+			else
+				SVG << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
+			SVG << "\" />" << '\n';
+			SVG << "\t<!-- Watts Min -->" << '\n';
+			SVG << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
+			SVG << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
+			for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWattsMin()) * WattsVerticalFactor) + GraphTop) << " ";
+			if (GraphWidth < TheValues.size())
+				SVG << GraphRight - 1 << "," << GraphBottom - 1;
+			else
+				SVG << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
+			SVG << "\" />" << '\n';
+		}
+		else
+		{
+			// Watts Graphic as a Filled polygon
+			SVG << "\t<!-- Watts -->" << '\n';
+			SVG << "\t<polygon style=\"fill:lime;stroke:green\" points=\"";
+			SVG << GraphLeft + 1 << "," << GraphBottom - 1 << " ";
+			for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((WattsMax - TheValues[index].GetWatts()) * WattsVerticalFactor) + GraphTop) << " ";
+			if (GraphWidth < TheValues.size())
+				SVG << GraphRight - 1 << "," << GraphBottom - 1;
+			else
+				SVG << GraphRight - (GraphWidth - TheValues.size()) << "," << GraphBottom - 1;
+			SVG << "\" />" << '\n';
+		}
+
+		// Top Line
+		SVG << Chrome.TopLine;
+		SVG << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphTop + 5 << "\">" << CSVGWriter::General{ AmpsMax, 2 } << "</text>" << '\n';
+		SVG << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphTop + 4 << "\">" << CSVGWriter::General{ WattsMax, 2 } << "</text>" << '\n';
+
+		// Bottom Line
+		SVG << Chrome.BottomLine;
+		SVG << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphBottom + 5 << "\">" << CSVGWriter::General{ AmpsMin, 2 } << "</text>" << '\n';
+		SVG << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphBottom + 4 << "\">" << CSVGWriter::General{ WattsMin, 2 } << "</text>" << '\n';
+
+		// Left and Right Lines
+		SVG << Chrome.SideLines;
+
+		// Vertical Division Dashed Lines
+		for (auto index = 1; index < 4; index++)
+		{
+			SVG << Chrome.DivisionLines[index];
+			SVG << "\t<text style=\"fill:blue;text-anchor:end\" x=\"" << GraphLeft - TickSize << "\" y=\"" << GraphTop + 4 + (GraphVerticalDivision * index) << "\">" << CSVGWriter::General{ AmpsMax - (AmpsVerticalDivision * index), 2 } << "</text>" << '\n';
+			SVG << "\t<text style=\"fill:green\" x=\"" << GraphRight + TickSize << "\" y=\"" << GraphTop + 4 + (GraphVerticalDivision * index) << "\">" << CSVGWriter::General{ WattsMax - (WattsVerticalDivision * index), 2 } << "</text>" << '\n';
+		}
+
+		// Horizontal Division Dashed Lines
+		for (auto index = 0; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+		{
+			struct tm UTC;
+			if (0 != localtime_r(&TheValues[index].Time, &UTC))
+			{
+				if (graph == GraphType::daily)
+				{
+					if (UTC.tm_min == 0)
+					{
+						if (UTC.tm_hour == 0)
+							SVG << Chrome.RedTicks[index];
+						else
+							SVG << Chrome.DashedTicks[index];
+						if (UTC.tm_hour % 2 == 0)
+							SVG << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << UTC.tm_hour << "</text>" << '\n';
+					}
+				}
+				else if (graph == GraphType::weekly)
+				{
+					const std::string Weekday[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+					if ((UTC.tm_hour == 0) && (UTC.tm_min == 0))
+					{
+						if (UTC.tm_wday == 1)
+							SVG << Chrome.RedTicks[index];
+						else
+							SVG << Chrome.DashedTicks[index];
+					}
+					else if ((UTC.tm_hour == 12) && (UTC.tm_min == 0))
+						SVG << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << Weekday[UTC.tm_wday] << "</text>" << '\n';
+				}
+				else if (graph == GraphType::monthly)
+				{
+					if ((UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
+						SVG << Chrome.RedTicks[index];
+					if ((UTC.tm_wday == 0) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
+						SVG << Chrome.DashedTicks[index];
+					else if ((UTC.tm_wday == 3) && (UTC.tm_hour == 12) && (UTC.tm_min == 0))
+						SVG << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">Week " << UTC.tm_yday / 7 + 1 << "</text>" << '\n';
+				}
+				else if (graph == GraphType::yearly)
+				{
+					const std::string Month[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+					if ((UTC.tm_yday == 0) && (UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
+						SVG << Chrome.RedTicks[index];
+					else if ((UTC.tm_mday == 1) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
+						SVG << Chrome.DashedTicks[index];
+					else if ((UTC.tm_mday == 15) && (UTC.tm_hour == 0) && (UTC.tm_min == 0))
+						SVG << "\t<text style=\"text-anchor:middle\" x=\"" << GraphLeft + index << "\" y=\"" << SVGHeight - 2 << "\">" << Month[UTC.tm_mon] << "</text>" << '\n';
+				}
+			}
+		}
+
+		// Directional Arrow
+		SVG << Chrome.Arrow;
+
+		if (MinMax)
+		{
+			// Amps Values as a filled polygon showing the minimum and maximum
+			SVG << "\t<!-- Amps MinMax -->" << '\n';
+			SVG << "\t<polygon style=\"fill:blue;stroke:blue\" points=\"";
+			for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmpsMax()) * AmpsVerticalFactor) + GraphTop) << " ";
+			for (auto index = (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()) - 1; index > 0; index--)
+				SVG << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmpsMin()) * AmpsVerticalFactor) + GraphTop) << " ";
+			SVG << "\" />" << '\n';
+		}
+		else
+		{
+			// Amps Values as a continuous line
+			SVG << "\t<!-- Amps -->" << '\n';
+			SVG << "\t<polyline style=\"fill:none;stroke:blue\" points=\"";
+			for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((AmpsMax - TheValues[index].GetAmps()) * AmpsVerticalFactor) + GraphTop) << " ";
+			SVG << "\" />" << '\n';
+		}
+
+		// Total Watt-Hour Values as a continuous line
+		if (DrawTotalWH)
+		{
+			SVG << "\t<!-- TotalWH -->" << '\n';
+			double TotalWHVerticalFactor = (GraphBottom - GraphTop) / (TotalWHMax - TotalWHMin);
+			SVG << "\t<polyline style=\"fill:none;stroke:OrangeRed\" points=\"";
+			for (auto index = 1; index < (GraphWidth < TheValues.size() ? GraphWidth : TheValues.size()); index++)
+				SVG << index + GraphLeft << "," << int(((TotalWHMax - TheValues[index].GetTotalWattHours()) * TotalWHVerticalFactor) + GraphTop) << " ";
+			SVG << "\" />" << '\n';
+		}
+
+		SVG << "</svg>" << '\n';
+		rval = true;
+	}
+	return(rval);
+}
+// Takes a curated vector of data points for a specific graph type and writes a SVG file to disk.
+// Returns true if the file was written.
+bool WriteSVG(std::vector<CKASAReading>& TheValues, const std::string& SVGFileName, const std::string& Title = "", const GraphType graph = GraphType::daily, const bool MinMax = false, const bool DrawTotalWH = false)
+{
+	bool rval = false;
+	if (!TheValues.empty())
+	{
+		// Graphs are written from the render threads, so each message is put together first and sent in one piece
+		std::ostringstream Message;
+		if (ConsoleVerbosity > 0)
+		{
+			Message << "[" << getTimeISO8601() << "] Writing: " << SVGFileName << " With Title: " << Title << '\n';
+			std::cout << Message.str() << std::flush;
+		}
+		else
+		{
+			Message << "Writing: " << SVGFileName << " With Title: " << Title << '\n';
+			std::cerr << Message.str() << std::flush;
+		}
+		thread_local std::string Buffer;	// kept between calls, so after the first graph it's already big enough
+		CSVGWriter SVG(Buffer);
+		if (BuildSVG(SVG, TheValues, Title, graph, MinMax, DrawTotalWH))
+		{
+			rval = ReplaceFile(SVGFileName, SVG, false, TheValues.begin()->Time);
+			if (rval && SVGGzip)
+				rval = ReplaceFile(SVGFileName + ".gz", SVG, true, TheValues.begin()->Time);
+		}
+	}
+	return(rval);
+}
+/////////////////////////////////////////////////////////////////////////////
+// Fixed set of worker threads running queued jobs in the order they were submitted
+class CThreadPool {
+public:
+	CThreadPool() : Running(0), bStop(false) { };
+	~CThreadPool() { Stop(); };
+	void Start(size_t ThreadCount);
+	void Submit(std::function<void()> Job);
+	size_t Pending(void);	// jobs queued or still running
+	void Stop(void);	// finishes everything already queued, then joins the threads
+protected:
+	void Work(void);
+	std::mutex Mutex;
+	std::condition_variable Available;
+	std::queue<std::function<void()>> Jobs;
+	std::vector<std::thread> Workers;
+	size_t Running;
+	bool bStop;
+};
+void CThreadPool::Start(size_t ThreadCount)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	bStop = false;
+	while (Workers.size() < ThreadCount)
+		Workers.push_back(std::thread(&CThreadPool::Work, this));
+}
+void CThreadPool::Submit(std::function<void()> Job)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (!Workers.empty())
+		{
+			Jobs.push(std::move(Job));
+			Available.notify_one();
+			return;
+		}
+	}
+	Job();	// without any threads the job is done right here
+}
+size_t CThreadPool::Pending(void)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return(Jobs.size() + Running);
+}
+void CThreadPool::Stop(void)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStop = true;
+	}
+	Available.notify_all();
+	for (auto& Worker : Workers)
+		if (Worker.joinable())
+			Worker.join();
+	Workers.clear();
+}
+void CThreadPool::Work(void)
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	while (!(bStop && Jobs.empty()))
+	{
+		if (Jobs.empty())
+			Available.wait(Lock);
+		else
+		{
+			auto Job(std::move(Jobs.front()));
+			Jobs.pop();
+			Running++;
+			Lock.unlock();
+			Job();
+			Lock.lock();
+			Running--;
+		}
+	}
+}
+CThreadPool SVGThreads;
+CThreadPool CompressThreads;	// one thread compressing finished logs, so the writer never waits on it
+/////////////////////////////////////////////////////////////////////////////
+// Bounded queue handing items from exactly one producer thread to exactly one consumer thread.
+// Neither side takes a lock. The consumer sleeps on an eventfd that the producer bumps after each push,
+// and a producer waiting for room sleeps on a second one that the consumer bumps when it pops.
+template <typename T, size_t Capacity>
+class CSPSCQueue {
+public:
+	CSPSCQueue() : Head(0), Tail(0), bProducerWaiting(false), Signal(eventfd(0, EFD_CLOEXEC)), Room(eventfd(0, EFD_CLOEXEC)) { };
+	~CSPSCQueue() { if (Signal != -1) close(Signal); if (Room != -1) close(Room); };
+	bool Push(T&& Item);	// Returns false if the queue is full, leaving Item untouched
+	void PushWait(T&& Item);	// Blocks the producer until there's room
+	bool Pop(T& Item);	// Returns false if the queue is empty
+	void Wait(void);	// Blocks the consumer until something has been pushed since the last wait
+	size_t Depth(void) const;	// Items pushed and not yet popped, safe to call from any thread
+	int WaitDescriptor(void) const { return(Signal); };	// readable when Wait wouldn't block, for a consumer driven by epoll
+protected:
+	std::vector<T> Items = std::vector<T>(Capacity);
+	alignas(64) std::atomic<size_t> Head;	// next item to pop, only written by the consumer
+	alignas(64) std::atomic<size_t> Tail;	// next slot to fill, only written by the producer
+	std::atomic<bool> bProducerWaiting;	// set by the producer before it sleeps on Room
+	int Signal;
+	int Room;
+};
+template <typename T, size_t Capacity>
+bool CSPSCQueue<T, Capacity>::Push(T&& Item)
+{
+	const size_t Slot = Tail.load(std::memory_order_relaxed);
+	if (Slot - Head.load(std::memory_order_acquire) >= Capacity)
+		return(false);
+	Items[Slot % Capacity] = std::move(Item);
+	Tail.store(Slot + 1, std::memory_order_release);
+	const uint64_t One = 1;
+	if (sizeof(One) != write(Signal, &One, sizeof(One)))
+		perror("eventfd write");
+	return(true);
+}
+template <typename T, size_t Capacity>
+void CSPSCQueue<T, Capacity>::PushWait(T&& Item)
+{
+	while (!Push(std::move(Item)))
+	{
+		// Announce the wait before looking again, so a pop in between either makes room or wakes us
+		bProducerWaiting.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (Push(std::move(Item)))
+		{
+			bProducerWaiting.store(false, std::memory_order_relaxed);
+			break;
+		}
+		uint64_t Count;
+		while ((-1 == read(Room, &Count, sizeof(Count))) && (errno == EINTR))
+			;
+	}
+}
+template <typename T, size_t Capacity>
+bool CSPSCQueue<T, Capacity>::Pop(T& Item)
+{
+	const size_t Slot = Head.load(std::memory_order_relaxed);
+	if (Slot == Tail.load(std::memory_order_acquire))
+		return(false);
+	Item = std::move(Items[Slot % Capacity]);
+	Head.store(Slot + 1, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (bProducerWaiting.load(std::memory_order_relaxed) && bProducerWaiting.exchange(false))
+	{
+		const uint64_t One = 1;
+		if (sizeof(One) != write(Room, &One, sizeof(One)))
+			perror("eventfd write");
+	}
+	return(true);
+}
+template <typename T, size_t Capacity>
+void CSPSCQueue<T, Capacity>::Wait(void)
+{
+	uint64_t Count;
+	while ((-1 == read(Signal, &Count, sizeof(Count))) && (errno == EINTR))
+		;
+}
+template <typename T, size_t Capacity>
+size_t CSPSCQueue<T, Capacity>::Depth(void) const
+{
+	const size_t Popped = Head.load(std::memory_order_acquire);	// read first, the tail never falls behind it
+	return(Tail.load(std::memory_order_acquire) - Popped);
+}
+/////////////////////////////////////////////////////////////////////////////
+// The main thread only does network I/O. Everything it receives goes to the aggregator thread,
+// which owns KasaMRTGLogs and KasaTitles. The aggregator passes log lines and graph snapshots
+// on to the writer thread, which owns the log files and SVG output.
+struct CPolledMessage {
+	enum class kind { reading, title, render, flush, stop, http } Kind;
+	std::string DeviceID = std::string();	// the path for an HTTP request
+	std::string Text = std::string();	// the log line for a reading, the alias for a title, If-None-Match for an HTTP request
+	uint64_t Request = 0;	// identifies an HTTP request to its answer
+};
+struct CWriterMessage {
+	enum class kind { log, svg, flush, stop } Kind;
+	std::string Name = std::string();	// DeviceID for a log line, file name for a graph
+	std::string Text = std::string();	// the log line, or the graph title
+	std::vector<CKASAReading> Values = std::vector<CKASAReading>();
+	GraphType Graph = GraphType::daily;
+	bool MinMax = false;
+	bool DrawTotalWH = false;
+};
+CSPSCQueue<CPolledMessage, 4096> PolledQueue;	// main thread to aggregator
+CSPSCQueue<CWriterMessage, 1024> WriterQueue;	// aggregator to writer
+size_t PolledDropped = 0;	// readings and titles thrown away because the aggregator had fallen behind, only touched by the main thread
+std::atomic<size_t> GraphsQueued(0);	// graphs handed to the writer and not written yet
+std::atomic<uint64_t> KasaPolls(0);	// requests sent to devices, counted by the main thread
+std::atomic<uint64_t> KasaPollFailures(0);	// requests that never got a usable answer
+std::atomic<uint64_t> LoggedBytes(0);	// appended to the log files by the writer thread
+// The aggregator's answer to an HTTP request from the main thread
+struct CHTTPResponse {
+	uint64_t Request = 0;
+	int Status = 0;
+	std::string ContentType = std::string();
+	std::string ETag = std::string();
+	std::shared_ptr<const std::string> Body = nullptr;
+};
+CSPSCQueue<CHTTPResponse, 256> ResponseQueue;	// aggregator to main thread
+/////////////////////////////////////////////////////////////////////////////
+void WriteAllSVG()
+{
+	// Runs on the aggregator thread. If the graphs from the last pass aren't all written yet they stay dirty and get picked up next time
+	if (GraphsQueued.load() > 0)
+		return;
+	// Each graph is rendered from its own copy of the tier, taken here while nothing else is changing the logs
+	auto RenderSVG = [](CMRTGLog& TheLog, const std::string& DeviceID, const std::string& SVGFileName, const std::string& Title, const GraphType graph, const bool MinMax, const bool DrawTotalWH)
+	{
+		if (TheLog.Dirty[int(graph)])
+		{
+			std::vector<CKASAReading> TheValues;
+			ReadMRTGData(DeviceID, TheValues, graph);
+			TheLog.Dirty[int(graph)] = false;
+			GraphsQueued++;
+			WriterQueue.PushWait({ CWriterMessage::kind::svg, SVGFileName, Title, std::move(TheValues), graph, MinMax, DrawTotalWH });
+		}
+	};
+#ifdef DEBUG
+	std::ofstream IndexFile;
+	std::ostringstream IndexFilename;
+	IndexFilename << SVGDirectory;
+	IndexFilename << "index.html";
+	IndexFile.open(IndexFilename.str());
+	if (IndexFile.is_open())
+	{
+		IndexFile << "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">" << std::endl;
 		IndexFile << "<HTML>" << std::endl;
 		IndexFile << "<HEAD>" << std::endl;
 		IndexFile << "<meta http-equiv=\"refresh\" content=\"300\" >" << std::endl;
@@ -913,9 +1876,7 @@ void WriteAllSVG()
 		OutputFilename << "kasa-";
 		OutputFilename << DeviceID;
 		OutputFilename << "-day.svg";
-		std::vector<CKASAReading> TheValues;
-		ReadMRTGData(DeviceID, TheValues, GraphType::daily);
-		WriteSVG(TheValues, OutputFilename.str(), ssTitle, GraphType::daily, SVGMinMax & 0x01, SVGWattHour & 0x01);
+		RenderSVG(it->second, DeviceID, OutputFilename.str(), ssTitle, GraphType::daily, SVGMinMax & 0x01, SVGWattHour & 0x01);
 #ifdef DEBUG
 		if (IndexFile.is_open())
 			IndexFile << "\t<DIV class=\"image\"><img alt=\"" << ssTitle << " day\" src=\"" << OutputFilename.str().substr(SVGDirectory.length()) << "\" width=\"500\" height=\"135\"></DIV>" << std::endl;
@@ -925,8 +1886,7 @@ void WriteAllSVG()
 		OutputFilename << "kasa-";
 		OutputFilename << DeviceID;
 		OutputFilename << "-week.svg";
-		ReadMRTGData(DeviceID, TheValues, GraphType::weekly);
-		WriteSVG(TheValues, OutputFilename.str(), ssTitle, GraphType::weekly, SVGMinMax & 0x02, SVGWattHour & 0x02);
+		RenderSVG(it->second, DeviceID, OutputFilename.str(), ssTitle, GraphType::weekly, SVGMinMax & 0x02, SVGWattHour & 0x02);
 #ifdef DEBUG
 		if (IndexFile.is_open())
 			IndexFile << "\t<DIV class=\"image\"><img alt=\"" << ssTitle << " week\" src=\"" << OutputFilename.str().substr(SVGDirectory.length()) << "\" width=\"500\" height=\"135\"></DIV>" << std::endl;
@@ -936,8 +1896,7 @@ void WriteAllSVG()
 		OutputFilename << "kasa-";
 		OutputFilename << DeviceID;
 		OutputFilename << "-month.svg";
-		ReadMRTGData(DeviceID, TheValues, GraphType::monthly);
-		WriteSVG(TheValues, OutputFilename.str(), ssTitle, GraphType::monthly, SVGMinMax & 0x04, SVGWattHour & 0x04);
+		RenderSVG(it->second, DeviceID, OutputFilename.str(), ssTitle, GraphType::monthly, SVGMinMax & 0x04, SVGWattHour & 0x04);
 #ifdef DEBUG
 		if (IndexFile.is_open())
 			IndexFile << "\t<DIV class=\"image\"><img alt=\"" << ssTitle << " month\" src=\"" << OutputFilename.str().substr(SVGDirectory.length()) << "\" width=\"500\" height=\"135\"></DIV>" << std::endl;
@@ -947,8 +1906,7 @@ void WriteAllSVG()
 		OutputFilename << "kasa-";
 		OutputFilename << DeviceID;
 		OutputFilename << "-year.svg";
-		ReadMRTGData(DeviceID, TheValues, GraphType::yearly);
-		WriteSVG(TheValues, OutputFilename.str(), ssTitle, GraphType::yearly, SVGMinMax & 0x08, SVGWattHour & 0x08);
+		RenderSVG(it->second, DeviceID, OutputFilename.str(), ssTitle, GraphType::yearly, SVGMinMax & 0x08, SVGWattHour & 0x08);
 #ifdef DEBUG
 		if (IndexFile.is_open())
 			IndexFile << "\t<DIV class=\"image\"><img alt=\"" << ssTitle << " year\" src=\"" << OutputFilename.str().substr(SVGDirectory.length()) << "\" width=\"500\" height=\"135\"></DIV>" << std::endl;
@@ -958,251 +1916,2309 @@ void WriteAllSVG()
 #ifdef DEBUG
 	if (IndexFile.is_open())
 	{
-		IndexFile << "</BODY>" << std::endl;
-		IndexFile << "</HTML>" << std::endl;
-		IndexFile.close();
+		IndexFile << "</BODY>" << std::endl;
+		IndexFile << "</HTML>" << std::endl;
+		IndexFile.close();
+	}
+#endif // DEBUG
+}
+/////////////////////////////////////////////////////////////////////////////
+bool ValidateDirectory(std::string& DirectoryName)
+{
+	//TODO: I want to make sure the dorectory name ends with a "/"
+	if (DirectoryName.back() != '/')
+		DirectoryName += '/';
+	//TODO: I want to make sure the dorectory exists
+	//TODO: I want to make sure the dorectory is writable by the current user
+	return(true);
+}
+std::string GenerateLogFileName(const std::string &DeviceID, const std::string_view Extension = ".txt")
+{
+	std::ostringstream OutputFilename;
+	OutputFilename << LogDirectory;
+	OutputFilename << "kasa-";
+	OutputFilename << DeviceID;
+	time_t timer;
+	time(&timer);
+	struct tm UTC;
+	if (0 != gmtime_r(&timer, &UTC))
+		if (!((UTC.tm_year == 70) && (UTC.tm_mon == 0) && (UTC.tm_mday == 1)))
+			OutputFilename << "-" << std::dec << UTC.tm_year + 1900 << "-" << std::setw(2) << std::setfill('0') << UTC.tm_mon + 1;
+	OutputFilename << Extension;
+	return(OutputFilename.str());
+}
+/////////////////////////////////////////////////////////////////////////////
+// Binary log segments hold the same readings as the text logs in about an eighth of the space, and replay without any parsing.
+// A segment is a header naming the device, followed by blocks appended as the readings are logged. Each block is
+//   uint32_t Count
+//   int32_t  TimeOffset[Count]	seconds after the segment's StartTime
+//   int32_t  MilliWatts[Count]
+//   int32_t  MilliVolts[Count]
+//   int32_t  MilliAmps[Count]
+//   int64_t  MilliWattHours[Count]
+//   uint32_t CRC32 of the block up to here
+// in the byte order of the host. A block that's cut short or fails its checksum ends the segment, it's what
+// an interrupted append leaves behind, and is cut off before anything more is appended.
+class CLogSegment {
+public:
+	static const uint32_t BlockReadings = 1024;	// the most readings put in one block
+	static size_t Append(const std::string& FileName, const std::string_view DeviceID, const std::vector<CKASAReading>& TheReadings);	// returns the bytes appended, 0 on failure
+	template <typename ReadingFunction>
+	static bool Read(const std::string& FileName, ReadingFunction TheReadingHandler);
+protected:
+	struct CHeader {
+		char Magic[4];
+		uint32_t Version;
+		int64_t StartTime;
+		char DeviceID[64];
+	};
+	static const size_t ReadingSize = 4 * sizeof(int32_t) + sizeof(int64_t);
+	template <typename ReadingFunction>
+	static size_t Walk(const char* Data, const size_t Size, ReadingFunction TheReadingHandler);
+};
+// Hands every reading in Data to TheReadingHandler, returning how much of Data holds intact blocks
+template <typename ReadingFunction>
+size_t CLogSegment::Walk(const char* Data, const size_t Size, ReadingFunction TheReadingHandler)
+{
+	CHeader Header;
+	if (Size < sizeof(Header))
+		return(0);
+	memcpy(&Header, Data, sizeof(Header));
+	if ((0 != memcmp(Header.Magic, "KSEG", sizeof(Header.Magic))) || (Header.Version != 1))
+		return(0);
+	const std::string_view DeviceID(Header.DeviceID, strnlen(Header.DeviceID, sizeof(Header.DeviceID)));
+	size_t Position = sizeof(Header);
+	while (Size - Position >= 2 * sizeof(uint32_t))
+	{
+		uint32_t Count;
+		memcpy(&Count, Data + Position, sizeof(Count));
+		const size_t BlockSize = sizeof(Count) + Count * ReadingSize + sizeof(uint32_t);
+		if ((Count == 0) || (Count > BlockReadings) || (BlockSize > Size - Position))
+			break;
+		uint32_t Checksum;
+		memcpy(&Checksum, Data + Position + BlockSize - sizeof(Checksum), sizeof(Checksum));
+		if (Checksum != uint32_t(crc32(0, (const Bytef *)(Data + Position), BlockSize - sizeof(Checksum))))
+			break;
+		const char* TimeOffsets = Data + Position + sizeof(Count);
+		const char* MilliWatts = TimeOffsets + Count * sizeof(int32_t);
+		const char* MilliVolts = MilliWatts + Count * sizeof(int32_t);
+		const char* MilliAmps = MilliVolts + Count * sizeof(int32_t);
+		const char* MilliWattHours = MilliAmps + Count * sizeof(int32_t);
+		for (size_t index = 0; index < Count; index++)
+		{
+			CKASAReading TheReading;
+			int32_t TimeOffset;
+			memcpy(&TimeOffset, TimeOffsets + index * sizeof(int32_t), sizeof(int32_t));
+			TheReading.Time = time_t(Header.StartTime + TimeOffset);
+			memcpy(&TheReading.MilliWatts, MilliWatts + index * sizeof(int32_t), sizeof(int32_t));
+			memcpy(&TheReading.MilliVolts, MilliVolts + index * sizeof(int32_t), sizeof(int32_t));
+			memcpy(&TheReading.MilliAmps, MilliAmps + index * sizeof(int32_t), sizeof(int32_t));
+			memcpy(&TheReading.MilliWattHours, MilliWattHours + index * sizeof(int64_t), sizeof(int64_t));
+			TheReading.MilliWattsMin = TheReading.MilliWattsMax = TheReading.MilliWatts;
+			TheReading.MilliVoltsMin = TheReading.MilliVoltsMax = TheReading.MilliVolts;
+			TheReading.MilliAmpsMin = TheReading.MilliAmpsMax = TheReading.MilliAmps;
+			TheReading.Averages = 1;
+			TheReadingHandler(DeviceID, TheReading);
+		}
+		Position += BlockSize;
+	}
+	return(Position);
+}
+// Hands every reading in the segment to TheReadingHandler(DeviceID, Reading), in the order they were logged
+template <typename ReadingFunction>
+bool CLogSegment::Read(const std::string& FileName, ReadingFunction TheReadingHandler)
+{
+	int FileDescriptor = open(FileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (FileDescriptor == -1)
+		return(false);
+	struct stat64 FileStat;
+	if ((0 == fstat64(FileDescriptor, &FileStat)) && (FileStat.st_size > 0))
+	{
+		void* FileMap = mmap(NULL, FileStat.st_size, PROT_READ, MAP_PRIVATE, FileDescriptor, 0);
+		if (FileMap != MAP_FAILED)
+		{
+			madvise(FileMap, FileStat.st_size, MADV_SEQUENTIAL);
+			Walk(static_cast<const char*>(FileMap), FileStat.st_size, TheReadingHandler);
+			munmap(FileMap, FileStat.st_size);
+		}
+	}
+	close(FileDescriptor);
+	return(true);
+}
+// Appends TheReadings to the segment, starting it if the file is new. Only the writer thread appends to segments.
+size_t CLogSegment::Append(const std::string& FileName, const std::string_view DeviceID, const std::vector<CKASAReading>& TheReadings)
+{
+	if (TheReadings.empty() || (DeviceID.size() >= sizeof(CHeader::DeviceID)))
+		return(0);
+	int FileDescriptor = open(FileName.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (FileDescriptor == -1)
+		return(0);
+	std::string Buffer;
+	CHeader Header;
+	struct stat64 FileStat;
+	off64_t FileSize = (0 == fstat64(FileDescriptor, &FileStat)) ? FileStat.st_size : 0;
+	static std::map<std::string, CHeader> Checked;	// headers of the segments whose end has been checked for a torn block since the program started
+	auto Known = Checked.find(FileName);
+	if (FileSize < off64_t(sizeof(Header)))
+	{
+		memset(&Header, 0, sizeof(Header));
+		memcpy(Header.Magic, "KSEG", sizeof(Header.Magic));
+		Header.Version = 1;
+		Header.StartTime = TheReadings.front().Time;
+		memcpy(Header.DeviceID, DeviceID.data(), DeviceID.size());
+		if (0 != ftruncate(FileDescriptor, 0))
+		{
+			close(FileDescriptor);
+			return(0);
+		}
+		Buffer.append((const char *)&Header, sizeof(Header));
+		Checked[FileName] = Header;
+	}
+	else if (Known == Checked.end())
+	{
+		std::string Existing(FileSize, '\0');
+		off64_t Intact = 0;
+		if (FileSize == pread64(FileDescriptor, Existing.data(), FileSize, 0))
+			Intact = Walk(Existing.data(), Existing.size(), [](const std::string_view, const CKASAReading&) {});
+		if (Intact == 0)
+		{
+			close(FileDescriptor);
+			return(0);	// not a segment, leave it alone
+		}
+		if ((Intact < FileSize) && (0 != ftruncate(FileDescriptor, Intact)))
+		{
+			close(FileDescriptor);
+			return(0);
+		}
+		memcpy(&Header, Existing.data(), sizeof(Header));
+		Checked[FileName] = Header;
+	}
+	else
+		Header = Known->second;
+	if (DeviceID != std::string_view(Header.DeviceID, strnlen(Header.DeviceID, sizeof(Header.DeviceID))))
+	{
+		close(FileDescriptor);
+		return(0);	// another device's segment
+	}
+	for (size_t First = 0; First < TheReadings.size(); First += BlockReadings)
+	{
+		const uint32_t Count = uint32_t(std::min(size_t(BlockReadings), TheReadings.size() - First));
+		const size_t BlockStart = Buffer.size();
+		Buffer.resize(BlockStart + sizeof(Count) + Count * ReadingSize + sizeof(uint32_t));
+		char* TimeOffsets = Buffer.data() + BlockStart + sizeof(Count);
+		char* MilliWatts = TimeOffsets + Count * sizeof(int32_t);
+		char* MilliVolts = MilliWatts + Count * sizeof(int32_t);
+		char* MilliAmps = MilliVolts + Count * sizeof(int32_t);
+		char* MilliWattHours = MilliAmps + Count * sizeof(int32_t);
+		memcpy(Buffer.data() + BlockStart, &Count, sizeof(Count));
+		for (size_t index = 0; index < Count; index++)
+		{
+			const CKASAReading& TheReading = TheReadings[First + index];
+			const int32_t TimeOffset = int32_t(TheReading.Time - Header.StartTime);
+			memcpy(TimeOffsets + index * sizeof(int32_t), &TimeOffset, sizeof(int32_t));
+			memcpy(MilliWatts + index * sizeof(int32_t), &TheReading.MilliWatts, sizeof(int32_t));
+			memcpy(MilliVolts + index * sizeof(int32_t), &TheReading.MilliVolts, sizeof(int32_t));
+			memcpy(MilliAmps + index * sizeof(int32_t), &TheReading.MilliAmps, sizeof(int32_t));
+			memcpy(MilliWattHours + index * sizeof(int64_t), &TheReading.MilliWattHours, sizeof(int64_t));
+		}
+		const uint32_t Checksum = uint32_t(crc32(0, (const Bytef *)(Buffer.data() + BlockStart), Buffer.size() - BlockStart - sizeof(Checksum)));
+		memcpy(Buffer.data() + Buffer.size() - sizeof(Checksum), &Checksum, sizeof(Checksum));
+	}
+	// One write for everything, so a crash leaves at most one torn block at the end
+	bool bWritten = true;
+	for (size_t Written = 0; bWritten && (Written < Buffer.size());)
+	{
+		ssize_t nRet = write(FileDescriptor, Buffer.data() + Written, Buffer.size() - Written);
+		if (nRet > 0)
+			Written += nRet;
+		else if (!((nRet == -1) && (errno == EINTR)))
+			bWritten = false;
+	}
+	if (0 != close(FileDescriptor))
+		bWritten = false;
+	if (!bWritten)
+		Checked.erase(FileName);	// look for the torn block next time
+	return(bWritten ? Buffer.size() : 0);
+}
+// Length of the extension on a log file name, what comes before it names the device and month. 0 if it isn't a log.
+size_t LogExtensionLength(const std::string_view FileName)
+{
+	for (const std::string_view Extension : { ".txt.gz", ".txt", ".seg" })
+		if ((FileName.size() > Extension.size()) && (FileName.substr(FileName.size() - Extension.size()) == Extension))
+			return(Extension.size());
+	return(0);
+}
+// Gzips a finished log file to name.gz beside it, keeping its modification time. The original
+// is removed once the compressed copy is complete, so one or the other always has every line.
+bool CompressLogFile(const std::string& FileName)
+{
+	int Input = open(FileName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (Input == -1)
+		return(false);
+	struct stat64 FileStat;
+	if (0 != fstat64(Input, &FileStat))
+	{
+		close(Input);
+		return(false);
+	}
+	const std::string CompressedFileName(FileName + ".gz");
+	const std::string TempFileName(CompressedFileName + ".tmp");
+	gzFile Output = gzopen(TempFileName.c_str(), "wbe");
+	if (Output == NULL)
+	{
+		close(Input);
+		return(false);
+	}
+	std::vector<char> Buffer(64 * 1024);
+	bool bWritten = true;
+	ssize_t nRet;
+	while (bWritten && (0 != (nRet = read(Input, Buffer.data(), Buffer.size()))))
+	{
+		if (nRet == -1)
+			bWritten = (errno == EINTR);
+		else if (nRet != gzwrite(Output, Buffer.data(), unsigned(nRet)))
+			bWritten = false;
+	}
+	close(Input);
+	if (Z_OK != gzclose(Output))
+		bWritten = false;
+	if (bWritten)
+	{
+		struct utimbuf CompressedFileTime;
+		CompressedFileTime.actime = FileStat.st_atime;
+		CompressedFileTime.modtime = FileStat.st_mtime;
+		utime(TempFileName.c_str(), &CompressedFileTime);
+		bWritten = (0 == rename(TempFileName.c_str(), CompressedFileName.c_str()));
+	}
+	if (!bWritten)
+	{
+		unlink(TempFileName.c_str());
+		std::cerr << "[" << getTimeISO8601() << "] unable to compress " << FileName << std::endl;
+		return(false);
+	}
+	unlink(FileName.c_str());
+	std::ostringstream Message;
+	if (ConsoleVerbosity > 0)
+	{
+		Message << "[" << getTimeISO8601() << "] Compressed: " << FileName << '\n';
+		std::cout << Message.str() << std::flush;
+	}
+	else
+	{
+		Message << "Compressed: " << FileName << '\n';
+		std::cerr << Message.str() << std::flush;
+	}
+	return(true);
+}
+// Hands every text log in the log directory that isn't for the current month to the compression thread
+void CompressFinishedLogs(void)
+{
+	DIR* dp;
+	if ((dp = opendir(LogDirectory.c_str())) != NULL)
+	{
+		struct dirent* dirp;
+		while ((dirp = readdir(dp)) != NULL)
+		{
+			const std::string_view Name(dirp->d_name);
+			if ((DT_REG == dirp->d_type) && (Name.substr(0, 5) == "kasa-") && (Name.size() > 9) && (Name.substr(Name.size() - 4) == ".txt"))
+			{
+				std::string DeviceID(Name.substr(5));
+				DeviceID.erase(std::min(DeviceID.find_first_of("-."), DeviceID.size()));
+				std::string FileName(LogDirectory + dirp->d_name);
+				if (FileName != GenerateLogFileName(DeviceID))
+					CompressThreads.Submit([FileName]() { CompressLogFile(FileName); });
+			}
+		}
+		closedir(dp);
+	}
+}
+bool GenerateLogFile(std::unordered_map<std::string, std::queue<std::string>> &KasaMap)
+{
+	bool rval = false;
+	static std::unordered_map<std::string, std::string> LogFileNames;	// the file each device last logged to, only used on the writer thread
+	for (auto it = KasaMap.begin(); it != KasaMap.end(); ++it)
+	{
+		std::queue<std::string>& LogLines = it->second;
+		if (!LogLines.empty()) // Only open the log file if there are entries to add
+		{
+			const std::string LogFileName(GenerateLogFileName(it->first));
+			std::string& PreviousLogFileName = LogFileNames[it->first];
+			if (LogCompress && !PreviousLogFileName.empty() && (PreviousLogFileName != LogFileName))
+				CompressThreads.Submit([FileName = PreviousLogFileName]() { CompressLogFile(FileName); });	// the month has rolled over, nothing more goes in the last one
+			PreviousLogFileName = LogFileName;
+			std::ofstream LogFile(LogFileName, std::ios_base::out | std::ios_base::app | std::ios_base::ate);
+			if (LogFile.is_open())
+			{
+				while (!LogLines.empty())
+				{
+					LogFile << LogLines.front() << std::endl;
+					LoggedBytes += LogLines.front().size() + 1;
+					LogLines.pop();
+				}
+				LogFile.close();
+				rval = true;
+			}
+		}
+	}
+	return(rval);
+}
+bool GenerateLogSegments(std::unordered_map<std::string, std::vector<CKASAReading>>& KasaMap)
+{
+	bool rval = false;
+	for (auto it = KasaMap.begin(); it != KasaMap.end(); ++it)
+	{
+		std::vector<CKASAReading>& TheReadings = it->second;
+		if (!TheReadings.empty())
+		{
+			const std::string FileName(GenerateLogFileName(it->first, ".seg"));
+			const size_t Appended = CLogSegment::Append(FileName, it->first, TheReadings);
+			if (Appended > 0)
+			{
+				LoggedBytes += Appended;
+				TheReadings.clear();
+				rval = true;
+			}
+			else
+			{
+				// Kept to be retried at the next flush, but not without bound if the segment stays unwritable
+				std::cerr << "[" << getTimeISO8601() << "] unable to append to " << FileName << std::endl;
+				const size_t MaxRetained = 4096;
+				if (TheReadings.size() > MaxRetained)
+					TheReadings.erase(TheReadings.begin(), TheReadings.end() - MaxRetained);
+			}
+		}
+	}
+	return(rval);
+}
+/////////////////////////////////////////////////////////////////////////////
+// Documents served over HTTP are built on the aggregator thread, straight from the in memory tiers,
+// and kept until the readings they were built from change.
+struct CHTTPDocument {
+	uint64_t Generation;	// of the readings it was built from
+	std::string Title;
+	std::string ETag;
+	std::string ContentType;
+	std::shared_ptr<const std::string> Body;
+};
+std::map<std::string, CHTTPDocument> HTTPDocuments;	// keyed by path, only used on the aggregator thread
+uint64_t ReadingsGeneration = 0;	// counts every reading stored, only used on the aggregator thread
+uint64_t HTTPDocumentsBuilt = 0;
+const time_t HTTPStartTime = time(NULL);	// part of every ETag, so tags from an earlier run never match
+void ReadingJSON(std::ostream& JSON, const CKASAReading& TheReading)
+{
+	JSON << "{\"date\":\"" << timeToISO8601(TheReading.Time) << "\",\"watts\":" << TheReading.GetWatts() << ",\"volts\":" << TheReading.GetVolts() << ",\"amps\":" << TheReading.GetAmps() << ",\"total_wh\":" << TheReading.GetTotalWattHours() << "}";
+}
+// Aliases are passed through as the devices reported them, they are already JSON strings
+std::string GetTitle(const std::string& DeviceID)
+{
+	auto Title = KasaTitles.find(DeviceID);
+	return((Title != KasaTitles.end()) ? Title->second : DeviceID);
+}
+// Four hex digits of a JSON \uXXXX escape, or -1 if they aren't there
+int JSONHex4(const std::string_view JSON, const size_t index)
+{
+	if (index + 4 > JSON.size())
+		return(-1);
+	int Value = 0;
+	for (size_t digit = index; digit < index + 4; digit++)
+	{
+		const char c = JSON[digit];
+		Value <<= 4;
+		if ((c >= '0') && (c <= '9'))
+			Value |= c - '0';
+		else if ((c >= 'a') && (c <= 'f'))
+			Value |= c - 'a' + 10;
+		else if ((c >= 'A') && (c <= 'F'))
+			Value |= c - 'A' + 10;
+		else
+			return(-1);
+	}
+	return(Value);
+}
+void AppendUTF8(std::string& Text, const uint32_t CodePoint)
+{
+	if (CodePoint < 0x80)
+		Text.push_back(char(CodePoint));
+	else if (CodePoint < 0x800)
+	{
+		Text.push_back(char(0xC0 | (CodePoint >> 6)));
+		Text.push_back(char(0x80 | (CodePoint & 0x3F)));
+	}
+	else if (CodePoint < 0x10000)
+	{
+		Text.push_back(char(0xE0 | (CodePoint >> 12)));
+		Text.push_back(char(0x80 | ((CodePoint >> 6) & 0x3F)));
+		Text.push_back(char(0x80 | (CodePoint & 0x3F)));
+	}
+	else
+	{
+		Text.push_back(char(0xF0 | (CodePoint >> 18)));
+		Text.push_back(char(0x80 | ((CodePoint >> 12) & 0x3F)));
+		Text.push_back(char(0x80 | ((CodePoint >> 6) & 0x3F)));
+		Text.push_back(char(0x80 | (CodePoint & 0x3F)));
+	}
+}
+// Aliases are JSON strings. They are unescaped to the UTF-8 text they stand for, \uXXXX and surrogate
+// pairs included, and that text is escaped the way Prometheus label values are: backslash, quote, and newline only.
+std::string PrometheusLabel(const std::string_view JSON)
+{
+	std::string Text;
+	Text.reserve(JSON.size());
+	for (size_t index = 0; index < JSON.size(); index++)
+	{
+		if ((JSON[index] != '\\') || (index + 1 >= JSON.size()))
+		{
+			Text.push_back(JSON[index]);
+			continue;
+		}
+		const char Escaped = JSON[++index];
+		switch (Escaped)
+		{
+		case 'b':
+			Text.push_back('\b');
+			break;
+		case 'f':
+			Text.push_back('\f');
+			break;
+		case 'n':
+			Text.push_back('\n');
+			break;
+		case 'r':
+			Text.push_back('\r');
+			break;
+		case 't':
+			Text.push_back('\t');
+			break;
+		case 'u':
+		{
+			const int CodeUnit = JSONHex4(JSON, index + 1);
+			if (CodeUnit < 0)
+			{
+				Text.append("\\u");	// not an escape after all, keep it as it was written
+				break;
+			}
+			index += 4;
+			uint32_t CodePoint = CodeUnit;
+			if ((CodeUnit >= 0xD800) && (CodeUnit <= 0xDBFF))
+			{
+				const int Low = ((index + 2 < JSON.size()) && (JSON[index + 1] == '\\') && (JSON[index + 2] == 'u')) ? JSONHex4(JSON, index + 3) : -1;
+				if ((Low >= 0xDC00) && (Low <= 0xDFFF))
+				{
+					CodePoint = 0x10000 + ((CodeUnit - 0xD800) << 10) + (Low - 0xDC00);
+					index += 6;
+				}
+				else
+					CodePoint = 0xFFFD;	// a high surrogate on its own
+			}
+			else if ((CodeUnit >= 0xDC00) && (CodeUnit <= 0xDFFF))
+				CodePoint = 0xFFFD;	// a low surrogate on its own
+			AppendUTF8(Text, CodePoint);
+			break;
+		}
+		default:	// \" \\ \/ and anything a device made up
+			Text.push_back(Escaped);
+			break;
+		}
+	}
+	std::string Label;
+	Label.reserve(Text.size());
+	for (auto c : Text)
+	{
+		if ((c == '\\') || (c == '"'))
+		{
+			Label.push_back('\\');
+			Label.push_back(c);
+		}
+		else if (c == '\n')
+			Label.append("\\n");
+		else
+			Label.push_back(c);
+	}
+	return(Label);
+}
+// Prometheus text exposition of every device's latest reading and the process counters.
+// Scrapes usually come more often than readings, so the document is only rebuilt when a reading or
+// a counter has changed, and then into the same buffer unless a connection is still sending it.
+CHTTPResponse AnswerMetrics(const std::string& IfNoneMatch)
+{
+	static std::shared_ptr<std::string> Buffer;
+	static uint64_t Built[4] = { 0, 0, 0, 0 };
+	static std::string ETag;
+	const uint64_t Current[4] = { ReadingsGeneration, KasaPolls.load(), KasaPollFailures.load(), LoggedBytes.load() };
+	if ((Buffer == nullptr) || !std::equal(Current, Current + 4, Built))
+	{
+		if ((Buffer == nullptr) || (Buffer.use_count() > 1))
+			Buffer = std::make_shared<std::string>();
+		else
+			std::atomic_thread_fence(std::memory_order_acquire);	// pairs with the main thread releasing its copy
+		static const struct { std::string_view Name; std::string_view Help; double (CKASAReading::*Value)(void) const; } Gauges[] = {
+			{ "kasa_watts", "Latest power reading in watts.", &CKASAReading::GetWatts },
+			{ "kasa_volts", "Latest voltage reading in volts.", &CKASAReading::GetVolts },
+			{ "kasa_amps", "Latest current reading in amps.", &CKASAReading::GetAmps },
+			{ "kasa_total_wh", "Energy counter reported by the device in watt hours.", &CKASAReading::GetTotalWattHours },
+		};
+		std::vector<std::string> Labels;	// the same labels go on every gauge of a device
+		Labels.reserve(KasaMRTGLogs.size());
+		for (auto& Log : KasaMRTGLogs)
+			Labels.push_back("{device_id=\"" + Log.first + "\",alias=\"" + PrometheusLabel(GetTitle(Log.first)) + "\"} ");
+		CSVGWriter Metrics(*Buffer);
+		for (auto& Gauge : Gauges)
+		{
+			Metrics << "# HELP " << Gauge.Name << ' ' << Gauge.Help << "\n# TYPE " << Gauge.Name << " gauge\n";
+			auto Label = Labels.begin();
+			for (auto Log = KasaMRTGLogs.begin(); Log != KasaMRTGLogs.end(); Log++, Label++)
+				if (Log->second.Current.IsValid())
+					Metrics << Gauge.Name << *Label << CSVGWriter::General{ (Log->second.Current.*Gauge.Value)(), 12 } << '\n';
+		}
+		Metrics << "# HELP kasa_reading_timestamp_seconds When the latest reading was taken.\n# TYPE kasa_reading_timestamp_seconds gauge\n";
+		auto Label = Labels.begin();
+		for (auto Log = KasaMRTGLogs.begin(); Log != KasaMRTGLogs.end(); Log++, Label++)
+			if (Log->second.Current.IsValid())
+				Metrics << "kasa_reading_timestamp_seconds" << *Label << (long long)(Log->second.Current.Time) << '\n';
+		Metrics << "# HELP kasa_polls_total Requests sent to devices.\n# TYPE kasa_polls_total counter\nkasa_polls_total " << Current[1] << '\n';
+		Metrics << "# HELP kasa_poll_failures_total Requests to devices that got no usable answer.\n# TYPE kasa_poll_failures_total counter\nkasa_poll_failures_total " << Current[2] << '\n';
+		Metrics << "# HELP kasa_logged_bytes_total Bytes appended to the log files.\n# TYPE kasa_logged_bytes_total counter\nkasa_logged_bytes_total " << Current[3] << '\n';
+		std::copy(Current, Current + 4, Built);
+		std::ostringstream NewETag;
+		NewETag << "\"" << std::hex << HTTPStartTime << "-" << ++HTTPDocumentsBuilt << "\"";
+		ETag = NewETag.str();
+	}
+	const bool bMatched = (IfNoneMatch == "*") || (IfNoneMatch.find(ETag) != std::string::npos);
+	return(CHTTPResponse{ 0, bMatched ? 304 : 200, "text/plain; version=0.0.4; charset=utf-8", ETag, Buffer });
+}
+// Answers GET requests for:
+//   /  or  /devices.json               every device's current reading
+//   /metrics                           the latest readings and process counters for Prometheus
+//   /kasa-<deviceId>.json              current reading, accumulator, and every tier of one device
+//   /kasa-<deviceId>-<day|week|month|year>.svg   the same graphs --svg writes
+CHTTPResponse AnswerHTTP(const std::string& Path, const std::string& IfNoneMatch)
+{
+	if (Path == "/metrics")
+		return(AnswerMetrics(IfNoneMatch));
+	CHTTPResponse Response{ 0, 404, "text/plain", "", std::make_shared<const std::string>("Not Found\n") };
+	static const std::string_view GraphNames[] = { "-day.svg", "-week.svg", "-month.svg", "-year.svg" };
+	const bool bIndex = (Path == "/") || (Path == "/devices.json");
+	std::string DeviceID;
+	int Graph = -1;	// a GraphType, or -1 for the JSON document
+	if (!bIndex)
+	{
+		const std::string_view Name(Path);
+		if ((Name.substr(0, 6) != "/kasa-") || (Name.size() < 12))
+			return(Response);
+		if (Name.substr(Name.size() - 5) == ".json")
+			DeviceID = Name.substr(6, Name.size() - 11);
+		else
+			for (auto index = 0; index < 4; index++)
+				if ((Name.size() > 6 + GraphNames[index].size()) && (Name.substr(Name.size() - GraphNames[index].size()) == GraphNames[index]))
+				{
+					DeviceID = Name.substr(6, Name.size() - 6 - GraphNames[index].size());
+					Graph = index;
+				}
+	}
+	auto Log = KasaMRTGLogs.find(DeviceID);
+	if (!bIndex && (Log == KasaMRTGLogs.end()))
+		return(Response);
+	const uint64_t Generation = bIndex ? ReadingsGeneration : Log->second.Generation;
+	const std::string Title(bIndex ? std::string() : GetTitle(DeviceID));
+	CHTTPDocument& Document = HTTPDocuments[Path];
+	if ((Document.Body == nullptr) || (Document.Generation != Generation) || (Document.Title != Title))
+	{
+		std::string Body;
+		if (Graph >= 0)
+		{
+			std::vector<CKASAReading> TheValues;
+			ReadMRTGData(DeviceID, TheValues, GraphType(Graph));
+			CSVGWriter SVG(Body);
+			if (!BuildSVG(SVG, TheValues, Title, GraphType(Graph), SVGMinMax & (1 << Graph), SVGWattHour & (1 << Graph)))
+			{
+				HTTPDocuments.erase(Path);
+				return(Response);
+			}
+			Document.ContentType = "image/svg+xml";
+		}
+		else
+		{
+			std::ostringstream JSON;
+			JSON << std::setprecision(12);
+			if (bIndex)
+			{
+				JSON << "[";
+				for (auto it = KasaMRTGLogs.begin(); it != KasaMRTGLogs.end(); it++)
+				{
+					JSON << ((it == KasaMRTGLogs.begin()) ? "\n" : ",\n") << "{\"deviceId\":\"" << it->first << "\",\"alias\":\"" << GetTitle(it->first) << "\",\"current\":";
+					ReadingJSON(JSON, it->second.Current);
+					JSON << "}";
+				}
+				JSON << "\n]\n";
+			}
+			else
+			{
+				static const char* TierNames[] = { "day", "week", "month", "year" };
+				JSON << "{\"deviceId\":\"" << DeviceID << "\",\"alias\":\"" << Title << "\",\n\"current\":";
+				ReadingJSON(JSON, Log->second.Current);
+				JSON << ",\n\"accumulator\":";
+				ReadingJSON(JSON, Log->second.Accumulator);
+				for (auto index = 0; index < 4; index++)
+				{
+					std::vector<CKASAReading> TheValues;
+					ReadMRTGData(DeviceID, TheValues, GraphType(index));
+					JSON << ",\n\"" << TierNames[index] << "\":[";
+					for (auto Value = TheValues.begin(); Value != TheValues.end(); Value++)
+					{
+						if (Value != TheValues.begin())
+							JSON << ",";
+						ReadingJSON(JSON, *Value);
+					}
+					JSON << "]";
+				}
+				JSON << "}\n";
+			}
+			Body = JSON.str();
+			Document.ContentType = "application/json";
+		}
+		std::ostringstream ETag;
+		ETag << "\"" << std::hex << HTTPStartTime << "-" << ++HTTPDocumentsBuilt << "\"";
+		Document.Generation = Generation;
+		Document.Title = Title;
+		Document.ETag = ETag.str();
+		Document.Body = std::make_shared<const std::string>(std::move(Body));
+	}
+	Response.Status = ((IfNoneMatch == "*") || (IfNoneMatch.find(Document.ETag) != std::string::npos)) ? 304 : 200;
+	Response.ContentType = Document.ContentType;
+	Response.ETag = Document.ETag;
+	Response.Body = Document.Body;
+	return(Response);
+}
+/////////////////////////////////////////////////////////////////////////////
+void AggregatorThread(void)
+{
+	for (bool bStop = false; !bStop;)
+	{
+		CPolledMessage Message;
+		if (!PolledQueue.Pop(Message))
+		{
+			PolledQueue.Wait();
+			continue;
+		}
+		switch (Message.Kind)
+		{
+		case CPolledMessage::kind::reading:
+		{
+			CKASAReading theReading(Message.Text);
+			if (theReading.IsValid())
+			{
+				UpdateMRTGData(Message.DeviceID, theReading);
+				ReadingsGeneration++;
+				std::string_view Value;
+				const bool bFloat = KasaJSONFind(Message.Text, "power", Value) || KasaJSONFind(Message.Text, "voltage", Value);
+				LiveState.Publish(Message.DeviceID, KasaMRTGLogs.find(Message.DeviceID)->second, &theReading, bFloat);
+			}
+			if (!LogSegments)
+				WriterQueue.PushWait({ CWriterMessage::kind::log, std::move(Message.DeviceID), std::move(Message.Text) });
+			else if (theReading.IsValid())
+				WriterQueue.PushWait({ CWriterMessage::kind::log, std::move(Message.DeviceID), "", { theReading } });
+			break;
+		}
+		case CPolledMessage::kind::title:
+			if (KasaTitles.insert(std::pair<std::string, std::string>(Message.DeviceID, Message.Text)).second)
+				ReadingsGeneration++;	// the device list shows titles
+			break;
+		case CPolledMessage::kind::http:
+		{
+			CHTTPResponse Response(AnswerHTTP(Message.DeviceID, Message.Text));
+			Response.Request = Message.Request;
+			ResponseQueue.PushWait(std::move(Response));
+			break;
+		}
+		case CPolledMessage::kind::render:
+			WriteAllSVG();
+			break;
+		case CPolledMessage::kind::flush:
+			WriterQueue.PushWait({ CWriterMessage::kind::flush });
+			break;
+		case CPolledMessage::kind::stop:
+			WriterQueue.PushWait({ CWriterMessage::kind::stop });
+			bStop = true;
+			break;
+		}
+	}
+}
+void WriterThread(void)
+{
+	std::unordered_map<std::string, std::queue<std::string>> LogLines;	// Responses waiting to be written to each device's log file
+	std::unordered_map<std::string, std::vector<CKASAReading>> LogReadings;	// or to its log segment
+	for (bool bStop = false; !bStop;)
+	{
+		CWriterMessage Message;
+		if (!WriterQueue.Pop(Message))
+		{
+			WriterQueue.Wait();
+			continue;
+		}
+		switch (Message.Kind)
+		{
+		case CWriterMessage::kind::log:
+			if (!Message.Values.empty())
+			{
+				std::vector<CKASAReading>& TheReadings = LogReadings[Message.Name];
+				TheReadings.insert(TheReadings.end(), Message.Values.begin(), Message.Values.end());
+			}
+			else
+				LogLines[Message.Name].push(std::move(Message.Text));
+			break;
+		case CWriterMessage::kind::svg:
+			SVGThreads.Submit([Message = std::move(Message)]() mutable { WriteSVG(Message.Values, Message.Name, Message.Text, Message.Graph, Message.MinMax, Message.DrawTotalWH); GraphsQueued--; });
+			break;
+		case CWriterMessage::kind::flush:
+			GenerateLogFile(LogLines);
+			GenerateLogSegments(LogReadings);
+			break;
+		case CWriterMessage::kind::stop:
+			GenerateLogFile(LogLines);
+			GenerateLogSegments(LogReadings);
+			bStop = true;
+			break;
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////
+// A small HTTP/1.1 server run from the main loop, on non-blocking sockets in the same epoll as the device
+// queries. The aggregator thread owns the readings, so each request is passed on to it through PolledQueue
+// and the answer comes back through ResponseQueue. A connection has one request at a time with the
+// aggregator. Requests pipelined behind it wait in its input buffer.
+class CHTTPServer {
+public:
+	CHTTPServer() : Listener(-1), EventPoll(-1), RequestCount(0) { };
+	~CHTTPServer() { Close(); };
+	bool Listen(const std::string& TheAddress, const int TheEventPoll);	// [address:]port, loopback if there's no address
+	bool Owns(const int FileDescriptor) const { return((FileDescriptor != -1) && ((FileDescriptor == Listener) || (Connections.count(FileDescriptor) > 0))); };
+	void Event(const int FileDescriptor, const uint32_t Events);
+	void Answer(void);	// sends whatever the aggregator has answered since the last call
+	void Expire(const time_t Now);	// closes connections that have been idle too long
+	void Close(void);
+protected:
+	struct CConnection {
+		std::string In;
+		std::string Out;
+		size_t OutSent = 0;
+		uint64_t Pending = 0;	// request waiting on the aggregator, 0 for none
+		bool bHead = false;
+		bool bKeepAlive = true;
+		bool bPeerClosed = false;	// the client has finished sending, it's closed once the answers are sent
+		time_t LastActive = 0;
+	};
+	static const size_t MaxConnections = 64;
+	static const size_t MaxRequestSize = 16 * 1024;
+	static const size_t MaxBuffered = 4 * MaxRequestSize;	// requests pipelined behind the one being answered, the socket isn't read past this
+	static const time_t IdleTimeout = 60;
+	void Accept(void);
+	void Process(const int Socket, CConnection& Connection);	// starts on the next complete request, if there is one
+	void Respond(const int Socket, CConnection& Connection, const int Status, const std::string_view ContentType, const std::string_view ETag, const std::string_view Body);
+	void Send(const int Socket, CConnection& Connection);
+	void WaitFor(const int Socket, const uint32_t Events);
+	void Drop(const int Socket);
+	int Listener;
+	int EventPoll;
+	uint64_t RequestCount;
+	std::map<int, CConnection> Connections;	// keyed by socket
+};
+bool CHTTPServer::Listen(const std::string& TheAddress, const int TheEventPoll)
+{
+	std::string Host("127.0.0.1");
+	std::string Port(TheAddress);
+	auto Colon = TheAddress.rfind(':');
+	if (Colon != std::string::npos)
+	{
+		Host = TheAddress.substr(0, Colon);
+		Port = TheAddress.substr(Colon + 1);
+		if ((Host.size() > 1) && (Host.front() == '[') && (Host.back() == ']'))	// [::1]:8080
+			Host = Host.substr(1, Host.size() - 2);
+	}
+	struct addrinfo Hints;
+	memset(&Hints, 0, sizeof(Hints));
+	Hints.ai_family = AF_UNSPEC;
+	Hints.ai_socktype = SOCK_STREAM;
+	Hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* Addresses = NULL;
+	if (0 != getaddrinfo(Host.empty() ? NULL : Host.c_str(), Port.c_str(), &Hints, &Addresses))
+		return(false);
+	for (auto Address = Addresses; (Address != NULL) && (Listener == -1); Address = Address->ai_next)
+	{
+		Listener = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+		if (Listener != -1)
+		{
+			int Reuse = 1;
+			setsockopt(Listener, SOL_SOCKET, SO_REUSEADDR, &Reuse, sizeof(Reuse));
+			if ((0 != bind(Listener, Address->ai_addr, Address->ai_addrlen)) || (0 != listen(Listener, SOMAXCONN)))
+			{
+				close(Listener);
+				Listener = -1;
+			}
+		}
+	}
+	freeaddrinfo(Addresses);
+	if (Listener == -1)
+		return(false);
+	EventPoll = TheEventPoll;
+	WaitFor(Listener, EPOLLIN);
+	return(true);
+}
+void CHTTPServer::WaitFor(const int Socket, const uint32_t Events)
+{
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events = Events;
+	Event.data.fd = Socket;
+	if (0 != epoll_ctl(EventPoll, EPOLL_CTL_MOD, Socket, &Event))
+		epoll_ctl(EventPoll, EPOLL_CTL_ADD, Socket, &Event);
+}
+void CHTTPServer::Event(const int FileDescriptor, const uint32_t Events)
+{
+	if (FileDescriptor == Listener)
+	{
+		Accept();
+		return;
+	}
+	auto Connection = Connections.find(FileDescriptor);
+	if (Connection == Connections.end())
+		return;
+	CConnection& TheConnection = Connection->second;
+	time(&TheConnection.LastActive);
+	if (Events & EPOLLIN)
+	{
+		char Buffer[4096];
+		ssize_t nRet = 1;	// not at the end, when the buffer is already full and nothing is read
+		while ((TheConnection.In.size() < MaxBuffered) && ((nRet = recv(FileDescriptor, Buffer, sizeof(Buffer), 0)) > 0))
+			TheConnection.In.append(Buffer, nRet);
+		if ((nRet == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			Drop(FileDescriptor);
+			return;
+		}
+		if (nRet == 0)
+		{
+			// A client may send its request and then close its side, it still gets the answer
+			TheConnection.bPeerClosed = true;
+			if ((TheConnection.Pending == 0) && (TheConnection.OutSent == TheConnection.Out.size()) && (TheConnection.In.find("\r\n\r\n") == std::string::npos))
+			{
+				Drop(FileDescriptor);
+				return;
+			}
+			WaitFor(FileDescriptor, (TheConnection.OutSent < TheConnection.Out.size()) ? uint32_t(EPOLLOUT) : 0);
+		}
+	}
+	else if (Events & (EPOLLERR | EPOLLHUP))
+	{
+		Drop(FileDescriptor);
+		return;
+	}
+	if (TheConnection.OutSent < TheConnection.Out.size())
+		Send(FileDescriptor, TheConnection);
+	else
+		Process(FileDescriptor, TheConnection);
+	// A client that keeps sending while it's being answered isn't read from again until the answer is sent
+	Connection = Connections.find(FileDescriptor);	// Send or Process may have dropped it
+	if ((Connection != Connections.end()) && (Connection->second.In.size() >= MaxBuffered))
+		WaitFor(FileDescriptor, (Connection->second.OutSent < Connection->second.Out.size()) ? uint32_t(EPOLLOUT) : 0);
+}
+void CHTTPServer::Accept(void)
+{
+	int Socket;
+	while ((Socket = accept4(Listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		if (Connections.size() >= MaxConnections)
+		{
+			close(Socket);
+			continue;
+		}
+		time(&Connections[Socket].LastActive);
+		WaitFor(Socket, EPOLLIN | EPOLLRDHUP);
+	}
+}
+void CHTTPServer::Process(const int Socket, CConnection& Connection)
+{
+	if ((Connection.Pending != 0) || (Connection.OutSent < Connection.Out.size()))
+		return;
+	const auto HeaderEnd = Connection.In.find("\r\n\r\n");
+	if (HeaderEnd == std::string::npos)
+	{
+		if (Connection.In.size() > MaxRequestSize)
+		{
+			Connection.bKeepAlive = false;
+			Connection.bHead = false;
+			Respond(Socket, Connection, 431, "text/plain", "", "Request Header Fields Too Large\n");
+		}
+		return;
+	}
+	const std::string Request(Connection.In, 0, HeaderEnd + 2);
+	Connection.In.erase(0, HeaderEnd + 4);
+	// Request line: method, target, version
+	const auto LineEnd = Request.find("\r\n");
+	std::istringstream RequestLine(Request.substr(0, LineEnd));
+	std::string Method, Target, Version;
+	RequestLine >> Method >> Target >> Version;
+	Connection.bKeepAlive = (Version == "HTTP/1.1");
+	std::string IfNoneMatch;
+	for (auto Start = LineEnd + 2; Start < Request.size();)
+	{
+		auto End = Request.find("\r\n", Start);
+		const std::string_view Line(Request.data() + Start, End - Start);
+		Start = End + 2;
+		auto Separator = Line.find(':');
+		if (Separator == std::string_view::npos)
+			continue;
+		std::string Name(Line.substr(0, Separator));
+		std::transform(Name.begin(), Name.end(), Name.begin(), ::tolower);
+		std::string_view Value(Line.substr(Separator + 1));
+		while (!Value.empty() && ((Value.front() == ' ') || (Value.front() == '\t')))
+			Value.remove_prefix(1);
+		if (Name == "connection")
+		{
+			std::string Option(Value);
+			std::transform(Option.begin(), Option.end(), Option.begin(), ::tolower);
+			if (Option.find("close") != std::string::npos)
+				Connection.bKeepAlive = false;
+			else if (Option.find("keep-alive") != std::string::npos)
+				Connection.bKeepAlive = true;
+		}
+		else if (Name == "if-none-match")
+			IfNoneMatch = Value;
+	}
+	if (Connection.bPeerClosed)
+		Connection.bKeepAlive = false;
+	Connection.bHead = (Method == "HEAD");
+	if ((Version.substr(0, 5) != "HTTP/") || Target.empty() || (Target.front() != '/'))
+	{
+		Connection.bKeepAlive = false;
+		Respond(Socket, Connection, 400, "text/plain", "", "Bad Request\n");
+	}
+	else if ((Method != "GET") && (Method != "HEAD"))
+		Respond(Socket, Connection, 405, "text/plain", "", "Method Not Allowed\n");
+	else
+	{
+		Target.erase(std::min(Target.find('?'), Target.size()));
+		Connection.Pending = ++RequestCount;
+		if (!PolledQueue.Push({ CPolledMessage::kind::http, Target, IfNoneMatch, Connection.Pending }))
+		{
+			Connection.Pending = 0;
+			Respond(Socket, Connection, 503, "text/plain", "", "Service Unavailable\n");
+		}
+	}
+}
+void CHTTPServer::Answer(void)
+{
+	ResponseQueue.Wait();	// clears the signal first, anything pushed after this signals again
+	CHTTPResponse Response;
+	while (ResponseQueue.Pop(Response))
+		for (auto& Connection : Connections)
+			if (Connection.second.Pending == Response.Request)
+			{
+				Connection.second.Pending = 0;
+				Respond(Connection.first, Connection.second, Response.Status, Response.ContentType, Response.ETag, *Response.Body);
+				break;	// Respond may have dropped the connection
+			}
+}
+void CHTTPServer::Respond(const int Socket, CConnection& Connection, const int Status, const std::string_view ContentType, const std::string_view ETag, const std::string_view Body)
+{
+	static const std::map<int, std::string_view> Reasons = { { 200, "OK" }, { 304, "Not Modified" }, { 400, "Bad Request" }, { 404, "Not Found" }, { 405, "Method Not Allowed" }, { 431, "Request Header Fields Too Large" }, { 503, "Service Unavailable" } };
+	const bool bBody = (Status != 304) && !Connection.bHead;
+	std::ostringstream Header;
+	Header << "HTTP/1.1 " << Status << " " << Reasons.at(Status) << "\r\n";
+	Header << "Server: KasaEnergyLogger\r\n";
+	if (Status != 304)
+	{
+		Header << "Content-Type: " << ContentType << "\r\n";
+		Header << "Content-Length: " << Body.size() << "\r\n";
+	}
+	if (Status == 405)
+		Header << "Allow: GET, HEAD\r\n";
+	if (!ETag.empty())
+		Header << "ETag: " << ETag << "\r\nCache-Control: no-cache\r\n";	// always check back, it's a 304 when nothing has changed
+	Header << "Connection: " << (Connection.bKeepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+	Connection.Out = Header.str();
+	if (bBody)
+		Connection.Out.append(Body);
+	Connection.OutSent = 0;
+	Send(Socket, Connection);
+}
+void CHTTPServer::Send(const int Socket, CConnection& Connection)
+{
+	while (Connection.OutSent < Connection.Out.size())
+	{
+		ssize_t nRet = send(Socket, Connection.Out.data() + Connection.OutSent, Connection.Out.size() - Connection.OutSent, MSG_NOSIGNAL);
+		if (nRet > 0)
+			Connection.OutSent += nRet;
+		else if ((nRet == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			WaitFor(Socket, (Connection.bPeerClosed || (Connection.In.size() >= MaxBuffered)) ? EPOLLOUT : EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+			return;
+		}
+		else if ((nRet == -1) && (errno == EINTR))
+			continue;
+		else
+		{
+			Drop(Socket);
+			return;
+		}
+	}
+	Connection.Out.clear();
+	Connection.OutSent = 0;
+	if (!Connection.bKeepAlive)
+	{
+		Drop(Socket);
+		return;
+	}
+	WaitFor(Socket, EPOLLIN | EPOLLRDHUP);
+	Process(Socket, Connection);	// the next pipelined request, if it's already here
+}
+void CHTTPServer::Drop(const int Socket)
+{
+	epoll_ctl(EventPoll, EPOLL_CTL_DEL, Socket, NULL);
+	close(Socket);
+	Connections.erase(Socket);	// an answer still coming from the aggregator finds no connection and is thrown away
+}
+void CHTTPServer::Expire(const time_t Now)
+{
+	std::vector<int> Idle;
+	for (auto& Connection : Connections)
+		if ((Connection.second.Pending == 0) && (difftime(Now, Connection.second.LastActive) > IdleTimeout))
+			Idle.push_back(Connection.first);
+	for (auto Socket : Idle)
+		Drop(Socket);
+}
+void CHTTPServer::Close(void)
+{
+	while (!Connections.empty())
+		Drop(Connections.begin()->first);
+	if (Listener != -1)
+	{
+		epoll_ctl(EventPoll, EPOLL_CTL_DEL, Listener, NULL);
+		close(Listener);
+		Listener = -1;
+	}
+}
+std::string HTTPAddress;	// If this remains empty, there's no HTTP server
+// Feeds chunks from TheReader through a reusable buffer, handing each complete line to TheLineHandler.
+// TheReader has the same contract as read(), returning the number of bytes placed in the buffer, 0 at the end, or -1 on error.
+template <typename ReadFunction, typename LineFunction>
+void SplitLines(ReadFunction TheReader, LineFunction TheLineHandler)
+{
+	std::vector<char> Buffer(64 * 1024);
+	size_t BufferUsed = 0;
+	ssize_t nRet;
+	while ((nRet = TheReader(Buffer.data() + BufferUsed, Buffer.size() - BufferUsed)) > 0)
+	{
+		BufferUsed += nRet;
+		const char* LineStart = Buffer.data();
+		const char* BufferEnd = Buffer.data() + BufferUsed;
+		const char* LineEnd;
+		while ((LineEnd = static_cast<const char*>(memchr(LineStart, '\n', BufferEnd - LineStart))) != NULL)
+		{
+			TheLineHandler(std::string_view(LineStart, LineEnd - LineStart));
+			LineStart = LineEnd + 1;
+		}
+		BufferUsed = BufferEnd - LineStart;
+		if (BufferUsed == Buffer.size())	// a single line longer than the buffer
+			Buffer.resize(Buffer.size() * 2);
+		else
+			memmove(Buffer.data(), LineStart, BufferUsed);
+	}
+	if (BufferUsed > 0)	// last line didn't end in a newline
+		TheLineHandler(std::string_view(Buffer.data(), BufferUsed));
+}
+// Hands the lines of the file to TheLineHandler last line first, for as long as it returns true.
+// The file is read backwards a block at a time, so only as much of the end of the file is read as the lines handed out need.
+template <typename LineFunction>
+bool ReadFileLinesReverse(const std::string& filename, LineFunction TheLineHandler)
+{
+	int FileDescriptor = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (FileDescriptor == -1)
+		return(false);
+	struct stat64 FileStat;
+	off64_t Position = (0 == fstat64(FileDescriptor, &FileStat)) ? FileStat.st_size : 0;
+	const off64_t BlockSize = 64 * 1024;
+	std::vector<char> Buffer;
+	size_t BufferUsed = 0;	// bytes at the front of Buffer not handed out yet, starting at Position in the file
+	bool bFileEnd = true;
+	for (;;)
+	{
+		const char* LineBreak;
+		while ((LineBreak = static_cast<const char*>(memrchr(Buffer.data(), '\n', BufferUsed))) != NULL)
+		{
+			const size_t LineStart = LineBreak - Buffer.data() + 1;
+			if (!TheLineHandler(std::string_view(Buffer.data() + LineStart, BufferUsed - LineStart)))
+			{
+				close(FileDescriptor);
+				return(true);
+			}
+			BufferUsed = LineStart - 1;
+		}
+		if (Position == 0)
+		{
+			if (BufferUsed > 0)	// first line of the file
+				TheLineHandler(std::string_view(Buffer.data(), BufferUsed));
+			break;
+		}
+		// The earliest line held may start further back, so the block before it goes in front of it
+		const off64_t ReadSize = std::min(BlockSize, Position);
+		Buffer.resize(BufferUsed);
+		Buffer.insert(Buffer.begin(), ReadSize, '\0');
+		Position -= ReadSize;
+		if (ReadSize != pread64(FileDescriptor, Buffer.data(), ReadSize, Position))
+			break;
+		BufferUsed += ReadSize;
+		if (bFileEnd && (Buffer[BufferUsed - 1] == '\n'))	// the newline ending the last line doesn't start another one
+			BufferUsed--;
+		bFileEnd = false;
+	}
+	close(FileDescriptor);
+	return(true);
+}
+// Hands each line of the file to TheLineHandler without copying it out of the file.
+// The file is memory mapped and walked in place, falling back to buffered reads when it can't be mapped.
+template <typename LineFunction>
+bool ReadFileLines(const std::string& filename, LineFunction TheLineHandler)
+{
+	int FileDescriptor = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (FileDescriptor == -1)
+		return(false);
+	struct stat64 FileStat;
+	if ((0 == fstat64(FileDescriptor, &FileStat)) && (FileStat.st_size > 0))
+	{
+		void* FileMap = mmap(NULL, FileStat.st_size, PROT_READ, MAP_PRIVATE, FileDescriptor, 0);
+		if (FileMap != MAP_FAILED)
+		{
+			madvise(FileMap, FileStat.st_size, MADV_SEQUENTIAL);
+			const char* LineStart = static_cast<const char*>(FileMap);
+			const char* FileEnd = LineStart + FileStat.st_size;
+			while (LineStart < FileEnd)
+			{
+				const char* LineEnd = static_cast<const char*>(memchr(LineStart, '\n', FileEnd - LineStart));
+				if (LineEnd == NULL)
+					LineEnd = FileEnd;
+				TheLineHandler(std::string_view(LineStart, LineEnd - LineStart));
+				LineStart = LineEnd + 1;
+			}
+			munmap(FileMap, FileStat.st_size);
+			close(FileDescriptor);
+			return(true);
+		}
+	}
+	SplitLines([FileDescriptor](char* Buffer, size_t BufferSize)
+		{
+			ssize_t nRet;
+			do nRet = read(FileDescriptor, Buffer, BufferSize);
+			while ((nRet == -1) && (errno == EINTR));
+			return(nRet);
+		}, TheLineHandler);
+	close(FileDescriptor);
+	return(true);
+}
+// Hands each line of a text log to TheLineHandler. Finished months that have been gzipped are
+// decompressed a buffer at a time straight into the line splitter.
+template <typename LineFunction>
+bool ReadLogLines(const std::string& filename, LineFunction TheLineHandler)
+{
+	if ((filename.size() <= 3) || (filename.substr(filename.size() - 3) != ".gz"))
+		return(ReadFileLines(filename, TheLineHandler));
+	gzFile Input = gzopen(filename.c_str(), "rbe");
+	if (Input == NULL)
+		return(false);
+	gzbuffer(Input, 128 * 1024);
+	SplitLines([Input](char* Buffer, size_t BufferSize) { return(gzread(Input, Buffer, unsigned(BufferSize))); }, TheLineHandler);
+	gzclose(Input);
+	return(true);
+}
+// Hands every valid reading in a log file of any format to TheReadingHandler(DeviceID, Reading), in the order they were logged
+template <typename ReadingFunction>
+void ReadLoggedReadings(const std::string& filename, ReadingFunction TheReadingHandler)
+{
+	std::ostringstream Message;	// composed first so lines from parallel readers don't interleave
+	if (ConsoleVerbosity > 0)
+		Message << "[" << getTimeISO8601() << "] Reading: " << filename << std::endl;
+	else
+		Message << "Reading: " << filename << std::endl;
+	(ConsoleVerbosity > 0 ? std::cout : std::cerr) << Message.str();
+	if ((filename.size() > 4) && (filename.substr(filename.size() - 4) == ".seg"))
+		CLogSegment::Read(filename, TheReadingHandler);
+	else
+		ReadLogLines(filename, [&TheReadingHandler](const std::string_view TheLine)
+			{
+				std::string_view DeviceID;
+				CKASAReading theReading(TheLine, &DeviceID);
+				if (theReading.IsValid())
+					TheReadingHandler(DeviceID, theReading);
+			});
+}
+void ReadLoggedData(const std::string& filename, std::map<std::string, CMRTGLog, std::less<>>& TheLogs = KasaMRTGLogs)
+{
+	ReadLoggedReadings(filename, [&TheLogs](const std::string_view DeviceID, CKASAReading& theReading)
+		{
+			UpdateMRTGData(DeviceID, theReading, TheLogs);
+		});
+}
+// Finds log files specific to this program then reads the contents into the memory mapped structure simulating MRTG log files.
+// Every log file belongs to a single device, so the files are grouped by the deviceId in their name and each group 
+// is replayed into a private map on its own thread. Groups are merged into KasaMRTGLogs as they finish.
+void ReadLoggedData(void)
+{
+	DIR* dp;
+	if ((dp = opendir(LogDirectory.c_str())) != NULL)
+	{
+		std::map<std::string, std::deque<std::string>> DeviceFiles;
+		struct dirent* dirp;
+		while ((dirp = readdir(dp)) != NULL)
+			if (DT_REG == dirp->d_type)
+			{
+				std::string filename = LogDirectory + std::string(dirp->d_name);
+				if ((filename.substr(LogDirectory.size(), 4) == "kasa") && (LogExtensionLength(filename) > 0))
+				{
+					// kasa-8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D-2021-05.txt or kasa-8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D.txt, or the same as .txt.gz or .seg
+					std::string DeviceID(dirp->d_name + 5);
+					DeviceID.erase(std::min(DeviceID.find_first_of("-."), DeviceID.size()));
+					auto fullname = realpath(filename.c_str(), NULL);
+					if (fullname != NULL)
+					{
+						filename = fullname;
+						free(fullname);
+					}
+					DeviceFiles[DeviceID].push_back(filename);
+				}
+			}
+		closedir(dp);
+		if (!DeviceFiles.empty())
+		{
+			// A month logged as text before switching to segments is replayed before the segment carrying on from it
+			auto Rank = [](const std::string& FileName) { return((LogExtensionLength(FileName) == 7) ? 0 : (FileName.back() == 't') ? 1 : 2); };	// .txt.gz, .txt, .seg
+			auto ReplayOrder = [&Rank](const std::string& a, const std::string& b)
+				{
+					const int Order = a.compare(0, a.size() - LogExtensionLength(a), b, 0, b.size() - LogExtensionLength(b));
+					return((Order < 0) || ((Order == 0) && (Rank(a) < Rank(b))));
+				};
+			std::vector<std::deque<std::string>*> Groups;
+			for (auto& DeviceGroup : DeviceFiles)
+			{
+				std::deque<std::string>& Files = DeviceGroup.second;
+				sort(Files.begin(), Files.end(), ReplayOrder);
+				// A text log still beside its compressed copy was being compressed when the program stopped, the copy is complete
+				for (size_t index = 1; index < Files.size();)
+					if ((Rank(Files[index]) == 1) && (Files[index] + ".gz" == Files[index - 1]))
+						Files.erase(Files.begin() + index);
+					else
+						index++;
+				Groups.push_back(&DeviceGroup.second);
+			}
+			std::atomic<size_t> NextGroup(0);
+			std::mutex MergeMutex;
+			std::map<std::string, std::set<size_t>> KeyGroups;	// the groups each device's readings turned up in
+			auto Worker = [&]()
+			{
+				for (auto index = NextGroup++; index < Groups.size(); index = NextGroup++)
+				{
+					std::map<std::string, CMRTGLog, std::less<>> GroupLogs;
+					for (auto& filename : *Groups[index])
+						ReadLoggedData(filename, GroupLogs);
+					std::lock_guard<std::mutex> Lock(MergeMutex);
+					for (auto& Log : GroupLogs)
+						KeyGroups[Log.first].insert(index);
+					KasaMRTGLogs.merge(GroupLogs);
+				}
+			};
+			size_t ThreadCount = std::max(1u, std::thread::hardware_concurrency());
+			std::vector<std::thread> Workers;
+			for (size_t index = 1; index < std::min(ThreadCount, Groups.size()); index++)
+				Workers.push_back(std::thread(Worker));
+			Worker();	// this thread takes a share of the work too
+			for (auto& thread : Workers)
+				thread.join();
+			// A file holding readings for a device other than the one in its name leaves that device in more than one group,
+			// and only the first group's part of it was kept by the merge. Its readings from all those groups are gathered
+			// and replayed again in time order.
+			std::map<std::string, std::vector<CKASAReading>, std::less<>> Tangled;
+			std::set<std::string> TangledFiles;
+			for (auto& Key : KeyGroups)
+				if (Key.second.size() > 1)
+				{
+					std::cerr << "readings for " << Key.first << " are in the logs of " << Key.second.size() << " devices, replaying them together" << std::endl;
+					Tangled[Key.first];
+					for (auto index : Key.second)
+						TangledFiles.insert(Groups[index]->begin(), Groups[index]->end());
+				}
+			if (!Tangled.empty())
+			{
+				std::vector<std::string> Files(TangledFiles.begin(), TangledFiles.end());
+				sort(Files.begin(), Files.end(), ReplayOrder);
+				for (auto& filename : Files)
+					ReadLoggedReadings(filename, [&Tangled](const std::string_view DeviceID, CKASAReading& theReading)
+						{
+							auto Readings = Tangled.find(DeviceID);
+							if (Readings != Tangled.end())
+								Readings->second.push_back(theReading);
+						});
+				for (auto& Readings : Tangled)
+				{
+					std::stable_sort(Readings.second.begin(), Readings.second.end(), [](const CKASAReading& a, const CKASAReading& b) { return(a.Time < b.Time); });
+					KasaMRTGLogs.erase(Readings.first);
+					for (auto& theReading : Readings.second)
+						UpdateMRTGData(Readings.first, theReading, KasaMRTGLogs);
+				}
+			}
+		}
+	}
+}
+// Turns every text log in the log directory, compressed or not, into a binary segment of the same name, removing the text log once its segment is written.
+// A segment already logged for the same month is merged with it, so switching to --segments part way through a month loses nothing.
+void ConvertLogsToSegments(void)
+{
+	DIR* dp;
+	if ((dp = opendir(LogDirectory.c_str())) == NULL)
+	{
+		std::cerr << "unable to read " << LogDirectory << std::endl;
+		return;
+	}
+	std::vector<std::string> FileNames;
+	struct dirent* dirp;
+	while ((dirp = readdir(dp)) != NULL)
+	{
+		const std::string_view Name(dirp->d_name);
+		if ((DT_REG == dirp->d_type) && (Name.substr(0, 5) == "kasa-") && (LogExtensionLength(Name) > 0) && (Name.substr(Name.size() - 4) != ".seg"))
+			FileNames.push_back(std::string(Name));
+	}
+	closedir(dp);
+	sort(FileNames.begin(), FileNames.end());
+	for (auto& Name : FileNames)
+	{
+		if (std::binary_search(FileNames.begin(), FileNames.end(), Name + ".gz"))
+		{
+			unlink((LogDirectory + Name).c_str());	// left behind by an interrupted compression, the compressed copy is complete
+			continue;
+		}
+		std::string DeviceID(Name.substr(5));
+		DeviceID.erase(std::min(DeviceID.find_first_of("-."), DeviceID.size()));
+		const std::string TextFileName(LogDirectory + Name);
+		const std::string SegmentFileName(LogDirectory + Name.substr(0, Name.size() - LogExtensionLength(Name)) + ".seg");
+		std::vector<CKASAReading> TheReadings;
+		CLogSegment::Read(SegmentFileName, [&TheReadings](const std::string_view, const CKASAReading& TheReading) { TheReadings.push_back(TheReading); });
+		size_t Foreign = 0;	// readings of another device, which a segment has no room for
+		ReadLogLines(TextFileName, [&](const std::string_view TheLine)
+			{
+				std::string_view LineDeviceID;
+				CKASAReading TheReading(TheLine, &LineDeviceID);
+				if (!TheReading.IsValid())
+					return;
+				if (LineDeviceID == DeviceID)
+					TheReadings.push_back(TheReading);
+				else
+					Foreign++;
+			});
+		struct stat64 TextStat;
+		if ((Foreign > 0) || TheReadings.empty() || (0 != stat64(TextFileName.c_str(), &TextStat)))
+		{
+			std::cerr << "Skipping: " << TextFileName << ((Foreign > 0) ? " has readings of other devices" : " has no readings") << std::endl;
+			continue;
+		}
+		std::stable_sort(TheReadings.begin(), TheReadings.end(), [](const CKASAReading& a, const CKASAReading& b) { return(a.Time < b.Time); });
+		const std::string TempFileName(SegmentFileName + ".tmp");
+		unlink(TempFileName.c_str());
+		const size_t SegmentSize = CLogSegment::Append(TempFileName, DeviceID, TheReadings);
+		if ((SegmentSize > 0) && (0 == rename(TempFileName.c_str(), SegmentFileName.c_str())))
+		{
+			unlink(TextFileName.c_str());
+			std::cerr << "Converted: " << TextFileName << " (" << TextStat.st_size << " bytes) to " << SegmentFileName << " (" << SegmentSize << " bytes, " << TheReadings.size() << " readings)" << std::endl;
+		}
+		else
+		{
+			unlink(TempFileName.c_str());
+			std::cerr << "unable to write " << SegmentFileName << std::endl;
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////
+// Writes the four lines MRTG expects for one device, from the sums of NumElements readings
+void WriteMRTGOutput(const std::string &DeviceID, std::ostream& Output, const long long NumElements, double power, double voltage, long long power_mw, long long voltage_mv)
+{
+	// Initial Averaging of data may have overflow issues that need to be fixed. 
+	// For possible solution see https://www.geeksforgeeks.org/compute-average-two-numbers-without-overflow/ 
+	// But it would be better to use a combination with https://www.geeksforgeeks.org/average-of-a-stream-of-numbers/
+	power /= double(NumElements);
+	voltage /= double(NumElements);
+	power_mw /= NumElements;
+	voltage_mv /= NumElements;
+
+	Output << std::dec; // make sure I'm putting things in decimal format
+	if (power_mw != 0)
+		Output << power_mw << std::endl; // current state of the second variable, normally 'outgoing bytes count'
+	else
+		Output << std::fixed << power * 1000.0 << std::endl; // current state of the second variable, normally 'outgoing bytes count'
+	if (voltage_mv != 0)
+		Output << voltage_mv << std::endl; // current state of the first variable, normally 'incoming bytes count'
+	else
+		Output << std::fixed << voltage * 1000.0 << std::endl; // current state of the first variable, normally 'incoming bytes count'
+	Output << " " << std::endl; // string (in any human readable format), uptime of the target.
+	Output << DeviceID << std::endl; // string, name of the target.
+}
+// Writes the four lines MRTG expects for one device to Output. Returns false, writing nothing, if the device hasn't logged anything in the last Minutes.
+bool GetMRTGOutput(const std::string &DeviceID, std::ostream& Output, const time_t now, const int Minutes = 5)
+{
+	long long NumElements = 0;
+	double power = 0;
+	double voltage = 0;
+	long long power_mw = 0;
+	long long voltage_mv = 0;
+	// Lines come newest first, so the reading stops at the first one outside the time window
+	const bool bText = ReadFileLinesReverse(GenerateLogFileName(DeviceID), [&](const std::string_view TheLine)
+	{
+		std::string_view Value;
+		if (!KasaJSONFind(TheLine, "date", Value))
+			return(true);
+		const bool bInWindow = (Minutes * 60.0) >= difftime(now, ISO8601totime(Value));
+		if (!bInWindow && !((Minutes == 0) && (NumElements == 0))) // HACK: Special Case to always accept the last logged value
+			return(false);
+		NumElements++;
+		CKasaJSONScanner Scanner(TheLine);
+		std::string_view Key;
+		while (Scanner.Next(Key, Value))
+		{
+			if (Key == "power")
+			{
+				double value = 0;
+				if (KasaJSONNumber(Value, value))
+					power += value;
+			}
+			else if (Key == "voltage")
+			{
+				double value = 0;
+				if (KasaJSONNumber(Value, value))
+					voltage += value;
+			}
+			else if (Key == "power_mw")
+			{
+				long long value = 0;
+				if (KasaJSONNumber(Value, value))
+					power_mw += value;
+			}
+			else if (Key == "voltage_mv")
+			{
+				long long value = 0;
+				if (KasaJSONNumber(Value, value))
+					voltage_mv += value;
+			}
+		}
+		return(bInWindow);
+	});
+	if (!bText)
+	{
+		// Logging to segments, which are read front to back, keeping the latest reading for the special case
+		CKASAReading Latest;
+		CLogSegment::Read(GenerateLogFileName(DeviceID, ".seg"), [&](const std::string_view, const CKASAReading& TheReading)
+			{
+				if ((Minutes * 60.0) >= difftime(now, TheReading.Time))
+				{
+					NumElements++;
+					power_mw += std::llround(TheReading.GetWatts() * 1000.0);
+					voltage_mv += std::llround(TheReading.GetVolts() * 1000.0);
+				}
+				Latest = TheReading;
+			});
+		if ((Minutes == 0) && (NumElements == 0) && Latest.IsValid())	// HACK: Special Case to always accept the last logged value
+		{
+			NumElements++;
+			power_mw += std::llround(Latest.GetWatts() * 1000.0);
+			voltage_mv += std::llround(Latest.GetVolts() * 1000.0);
+		}
+	}
+	if (NumElements > 0)	// Only return data if we've recieved data in the last 5 minutes
+		WriteMRTGOutput(DeviceID, Output, NumElements, power, voltage, power_mw, voltage_mv);
+	return(NumElements > 0);
+}
+// The same answer from the running daemon's shared memory, averaging the readings it has published over the same window the log file
+// would be. Returns false, so the log file is used, when the daemon hasn't been running long enough to have every reading in the window,
+// or a device reports floating point units, which the log file keeps more digits of.
+bool GetMRTGOutput(const std::string &DeviceID, std::ostream& Output, const time_t now, const CLiveState& Live, const int Minutes = 5)
+{
+	CKASAReading Current, Accumulator;
+	std::vector<CLiveState::RecentReading> Recent;
+	time_t RecentSince;
+	if (!Live.Read(DeviceID, Current, Accumulator, &Recent, &RecentSince) || Recent.empty())
+		return(false);
+	if (difftime(now - Minutes * 60, RecentSince) < 0)
+		return(false);
+	long long NumElements = 0;
+	long long power_mw = 0;
+	long long voltage_mv = 0;
+	for (auto& Reading : Recent)	// newest first, like the lines of the log file
+	{
+		const bool bInWindow = (Minutes * 60.0) >= difftime(now, time_t(Reading.Time));
+		if (!bInWindow && !((Minutes == 0) && (NumElements == 0))) // HACK: Special Case to always accept the last logged value
+			break;
+		if (Reading.bFloat)
+			return(false);
+		NumElements++;
+		power_mw += Reading.MilliWatts;
+		voltage_mv += Reading.MilliVolts;
+		if (!bInWindow)
+			break;
+	}
+	if (NumElements > 0)
+		WriteMRTGOutput(DeviceID, Output, NumElements, 0, 0, power_mw, voltage_mv);
+	return(NumElements > 0);
+}
+// Answers MRTG for every device asked for in a single run. "all" stands for every device with a log file or segment for the current month.
+// With an output directory each answer goes in its own kasa-<deviceId>.mrtg file there, for MRTG to read with cat, otherwise they are printed one after another.
+void GetMRTGOutput(const std::vector<std::string>& DeviceIDs, const std::string& OutputDirectory)
+{
+	// HACK: This next bit of getting the time formatted the same way I log it and 
+	// then converting it back to a time_t is a workaround for behavior I 
+	// currently do not understand and don't want to spend further time on now.
+	std::string ISOCurrentTime(getTimeISO8601());
+	time_t now = ISO8601totime(ISOCurrentTime);
+	// The running daemon's readings are used when they're recent enough, the log files otherwise
+	CLiveState Live;
+	const bool bLive = !LiveStateName.empty() && Live.Attach(LiveStateName);
+	std::set<std::string> Devices;
+	for (auto& DeviceID : DeviceIDs)
+	{
+		if (DeviceID != "all")
+			Devices.insert(DeviceID);
+		else
+		{
+			DIR* dp;
+			if ((dp = opendir(LogDirectory.c_str())) != NULL)
+			{
+				struct dirent* dirp;
+				while ((dirp = readdir(dp)) != NULL)
+					if ((DT_REG == dirp->d_type) && (0 == strncmp(dirp->d_name, "kasa-", 5)))
+					{
+						std::string LogDeviceID(dirp->d_name + 5);
+						LogDeviceID.erase(std::min(LogDeviceID.find_first_of("-."), LogDeviceID.size()));
+						if ((GenerateLogFileName(LogDeviceID) == LogDirectory + dirp->d_name) || (GenerateLogFileName(LogDeviceID, ".seg") == LogDirectory + dirp->d_name))
+							Devices.insert(LogDeviceID);
+					}
+				closedir(dp);
+			}
+		}
+	}
+	for (auto& DeviceID : Devices)
+	{
+		std::ostringstream Answer;
+		const bool bAnswered = (bLive && GetMRTGOutput(DeviceID, Answer, now, Live)) || GetMRTGOutput(DeviceID, Answer, now);
+		if (OutputDirectory.empty())
+			std::cout << Answer.str();
+		else
+		{
+			const std::string AnswerFileName(OutputDirectory + "kasa-" + DeviceID + ".mrtg");
+			if (bAnswered)
+			{
+				// Replaced in one step, so MRTG never reads a partly written answer
+				const std::string TempFileName(AnswerFileName + ".tmp");
+				std::ofstream AnswerFile(TempFileName, std::ios_base::out | std::ios_base::trunc);
+				if (AnswerFile.is_open())
+				{
+					AnswerFile << Answer.str();
+					AnswerFile.close();
+					if (AnswerFile.fail() || (0 != rename(TempFileName.c_str(), AnswerFileName.c_str())))
+						unlink(TempFileName.c_str());
+				}
+			}
+			else
+				unlink(AnswerFileName.c_str());	// an old answer would hide that the device has stopped reporting
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////
+volatile bool bRun = true; // This is declared volatile so that the compiler won't optimize it out of loops later in the code
+void SignalHandlerSIGINT(int signal)
+{
+	bRun = false;
+	std::cerr << "***************** SIGINT: Caught Ctrl-C, finishing loop and quitting. *****************" << std::endl;
+}
+void SignalHandlerSIGHUP(int signal)
+{
+	bRun = false;
+	std::cerr << "***************** SIGHUP: Caught HangUp, finishing loop and quitting. *****************" << std::endl;
+}
+/////////////////////////////////////////////////////////////////////////////
+// Fill the list of proper broadcast addresses
+void GetBroadcastAddresses(std::vector<struct sockaddr>& BroadcastAddresses)
+{
+	struct ifaddrs *ifaddr = NULL;
+	if (getifaddrs(&ifaddr) != -1)
+	{
+		for (auto ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+		{
+			if (ifa->ifa_addr != NULL)
+			{
+				int family = ifa->ifa_addr->sa_family;
+				if (ConsoleVerbosity > 0)
+				{
+					std::cout << ifa->ifa_name;
+					std::cout << "\t" << ((family == AF_PACKET) ? "AF_PACKET" : (family == AF_INET) ? "AF_INET" : (family == AF_INET6) ? "AF_INET6" : "???");
+					std::cout << " (" << family << ")";
+				}
+				if (family == AF_INET || family == AF_INET6)
+				{
+					char host[NI_MAXHOST] = { 0 };
+					if (0 == getnameinfo(ifa->ifa_addr,
+						(family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+						host, NI_MAXHOST,
+						NULL, 0, NI_NUMERICHOST))
+					{
+						if (ConsoleVerbosity > 0)
+							std::cout << "\taddress: " << host;
+					}
+					host[0] =  0;
+					if (0 == getnameinfo(ifa->ifa_ifu.ifu_broadaddr,
+						(family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+						host, NI_MAXHOST,
+						NULL, 0, NI_NUMERICHOST))
+					{
+						if (ConsoleVerbosity > 0)
+							std::cout << "\tbroadcast: " << host;
+						BroadcastAddresses.push_back(*ifa->ifa_ifu.ifu_broadaddr);
+					}
+
+					//if (ifa->ifa_flags & IFF_BROADCAST )
+					//in_addr baddr = ifa->ifa_ifu.ifu_broadaddr;
+					//std::cout << inet_ntoa(baddr) << std::endl;
+					//BroadcastAddresses.push_back(baddr);
+				}
+				if (ConsoleVerbosity > 0)
+					std::cout << std::endl;
+				//else if (family == AF_PACKET && ifa->ifa_data != NULL) 
+				//{
+				//	struct rtnl_link_stats *stats = (struct rtnl_link_stats *) ifa->ifa_data;
+				//	std::cout << "\t\ttx_packets = " << stats->tx_packets;
+				//	std::cout << " rx_packets = " << stats;
+				//	printf("\t\ttx_packets = %10u; rx_packets = %10u\n"
+				//		"\t\ttx_bytes   = %10u; rx_bytes   = %10u\n",
+				//		stats->tx_packets, stats->rx_packets,
+				//		stats->tx_bytes, stats->rx_bytes);
+				//}
+			}
+		}
+	}
+	freeifaddrs(ifaddr);
+
+	if (BroadcastAddresses.empty())
+	{
+		// https://beej.us/guide/bgnet/html/#structs
+		struct sockaddr sa;
+		struct sockaddr_in * sa4 = (struct sockaddr_in *)&sa;
+		memset(&sa, '\0', sizeof(sockaddr));
+		sa4->sin_family = AF_INET;
+		if (1 == inet_pton(AF_INET, "255.255.255.255", &(sa4->sin_addr)))
+			BroadcastAddresses.push_back(sa);
+	}
+}
+// Broadcast a UDP query for system info on every broadcast address
+void BroadcastDiscovery(const int ServerListenSocket, const std::vector<struct sockaddr>& BroadcastAddresses)
+{
+	for (auto Address : BroadcastAddresses)
+	{
+		if (Address.sa_family == AF_INET)
+		{
+			const std::string KasaSysinfo("{\"system\":{\"get_sysinfo\":{}}}");	// Get System Info (Software & Hardware Versions, MAC, deviceID, hwID etc.)
+			auto bufferlen = KasaSysinfo.length();
+			uint8_t buffer[256] = { 0 };
+			KasaEncrypt(KasaSysinfo, buffer);
+			struct sockaddr_in *sin = (struct sockaddr_in *) &Address;
+			struct sockaddr_in saBroadCast;
+			saBroadCast.sin_family = AF_INET;
+			saBroadCast.sin_addr = sin->sin_addr;
+			saBroadCast.sin_port = htons(9999);	// Port number
+			sendto(ServerListenSocket,			// Socket
+				buffer,							// Data buffer
+				bufferlen,						// Length of data
+				0,								// Flags
+				(const struct sockaddr *)&saBroadCast,		// Server address
+				sizeof(struct sockaddr));		// Length of address
+			if (ConsoleVerbosity > 0)
+			{
+				char BroadcastName[INET6_ADDRSTRLEN] = { 0 };
+				struct sockaddr_in* foo = (struct sockaddr_in*)&saBroadCast;
+				inet_ntop(saBroadCast.sin_family, &(foo->sin_addr), BroadcastName, INET6_ADDRSTRLEN);
+				std::cout << "[" << getTimeISO8601() << "] broadcast (" << BroadcastName << ") : " << KasaSysinfo << std::endl;
+			}
+		}
+	}
+}
+// Recieve any reponses to the UDP broadcast, adding devices that monitor energy to the map
+void ReceiveDiscovery(const int ServerListenSocket, std::unordered_map<std::string, CKasaClient>& KasaClients, const time_t CurrentTime)
+{
+	uint8_t szBuf[8192];
+	struct sockaddr sa;
+	socklen_t sa_len = sizeof(struct sockaddr);
+	ssize_t nRet = 0;
+	// Always check for UDP Messages
+	while ((nRet = recvfrom(ServerListenSocket, szBuf, sizeof(szBuf), 0, &sa, &sa_len)) > 0)
+	{
+		const std::string ClientResponse(KasaDecrypt(szBuf, nRet));
+		char ClientHostname[INET6_ADDRSTRLEN] = { 0 };
+		if (sa.sa_family == AF_INET)
+		{
+			struct sockaddr_in * foo = (struct sockaddr_in *)&sa;
+			inet_ntop(sa.sa_family, &(foo->sin_addr), ClientHostname, INET6_ADDRSTRLEN);
+		}
+		else if (sa.sa_family == AF_INET6)
+		{
+			struct sockaddr_in6 * foo = (struct sockaddr_in6 *)&sa;
+			inet_ntop(sa.sa_family, &(foo->sin6_addr), ClientHostname, INET6_ADDRSTRLEN);
+		}
+		if (ConsoleVerbosity > 0)
+			std::cout << "[" << getTimeISO8601() << "] client (" << ClientHostname << ") says \"" << ClientResponse << "\"" << std::endl;
+		if (ClientResponse.find("\"feature\":\"TIM:ENE\"") != std::string::npos)
+		{
+			// Then I want to add the device to my list to be polled for energy usage
+			const std::string ssParentID(CKasaClient::ParseDeviceID(ClientResponse));
+			auto ret = KasaClients.try_emplace(ssParentID, sa, CurrentTime, ClientResponse);
+			CKasaClient& Parent = ret.first->second;	// references into the registry survive rehashing as outlets are added
+			if (ConsoleVerbosity > 0)
+				if (ret.second)
+					std::cout << "[" << getTimeISO8601() << "] adding (" << ClientHostname << ")" << std::endl;
+			if ((!ret.second) && Parent.SetAddress(sa))
+			{
+				// The device has a new IP address, and its outlets are reached through it
+				if (ConsoleVerbosity > 0)
+					std::cout << "[" << getTimeISO8601() << "] moved (" << ClientHostname << ")" << std::endl;
+				for (auto& ChildID : Parent.Children)
+					KasaClients.at(ChildID).SetAddress(sa);
+			}
+			Parent.date = CurrentTime;
+
+			// This adds reported alias information to the TitleMap
+			std::string_view Title;
+			if (KasaJSONFind(ClientResponse, "alias", Title))
+				if (!PolledQueue.Push({ CPolledMessage::kind::title, ssParentID, std::string(Title) }))
+				{
+					PolledDropped++;
+					std::cerr << "[" << getTimeISO8601() << "] [" << ClientHostname << "] reading queue full, dropped title for " << ssParentID << std::endl;
+				}
+			
+			std::string_view Children;
+			if (KasaJSONFind(ClientResponse, "children", Children) && (Children == "["))
+			{
+				//here we need to parse the client request and add a new map entry for each "id"
+				std::string_view ssChildren(ClientResponse);
+				ssChildren.remove_prefix(Children.data() - ClientResponse.data());
+				ssChildren = ssChildren.substr(1, KasaJSONSpan(ssChildren) - 2);	// contents between the square brackets
+				for (auto pos = ssChildren.find('{'); pos != std::string_view::npos; pos = ssChildren.find('{', pos))
+				{
+					auto len = KasaJSONSpan(ssChildren.substr(pos));
+					std::string ssChild;
+					ssChild.reserve(len + ssParentID.length());
+					for (auto ch : ssChildren.substr(pos, len))
+						if (ch != '\\')
+							ssChild += ch;
+					pos += len;
+					auto idpos = ssChild.find("id\":\"");
+					if (idpos != std::string::npos)
+						ssChild.insert(idpos + 5, ssParentID);
+					const std::string ssChildID(CKasaClient::ParseDeviceID(ssChild));
+					ret = KasaClients.try_emplace(ssChildID, sa, CurrentTime, ssChild, ssParentID);
+					if (ret.second)
+					{
+						Parent.Children.push_back(ssChildID);
+						if (ConsoleVerbosity > 0)
+							std::cout << "[" << getTimeISO8601() << "] adding (" << ClientHostname << ")" << ssChild << std::endl;
+					}
+					// This adds reported alias information to the TitleMap
+					if (KasaJSONFind(ssChild, "alias", Title))
+						if (!PolledQueue.Push({ CPolledMessage::kind::title, ssChildID, std::string(Title) }))
+						{
+							PolledDropped++;
+							std::cerr << "[" << getTimeISO8601() << "] [" << ClientHostname << "] reading queue full, dropped title for " << ssChildID << std::endl;
+						}
+				}
+			}
+		}
+	}
+}
+// Device names are only used in messages. Reverse lookups happen on a worker thread, and each
+// address is looked up once. Until the name arrives, the numeric address is shown instead.
+class CHostNameCache {
+public:
+	CHostNameCache() : bStop(false) { };
+	~CHostNameCache();
+	std::string Lookup(const CKasaClient& TheClient);
+protected:
+	void Resolve(void);
+	std::mutex Mutex;
+	std::condition_variable Pending;
+	std::queue<std::pair<struct sockaddr_storage, socklen_t>> Requests;
+	std::map<std::string, std::string> Names;	// numeric address to the name shown for it
+	std::thread Worker;
+	bool bStop;
+};
+CHostNameCache::~CHostNameCache()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStop = true;
+	}
+	Pending.notify_all();
+	if (Worker.joinable())
+		Worker.join();
+}
+std::string CHostNameCache::Lookup(const CKasaClient& TheClient)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	auto Name = Names.find(TheClient.NumericHost);
+	if (Name != Names.end())
+		return(Name->second);
+	Names.insert(std::pair<std::string, std::string>(TheClient.NumericHost, TheClient.NumericHost));
+	Requests.push(std::pair<struct sockaddr_storage, socklen_t>(TheClient.ConnectAddress, TheClient.ConnectAddressLength));
+	if (!Worker.joinable())
+		Worker = std::thread(&CHostNameCache::Resolve, this);
+	Pending.notify_one();
+	return(TheClient.NumericHost);
+}
+void CHostNameCache::Resolve(void)
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	while (!bStop)
+	{
+		if (Requests.empty())
+			Pending.wait(Lock);
+		else
+		{
+			auto Request = Requests.front();
+			Requests.pop();
+			Lock.unlock();
+			char bufNumeric[255] = { 0 };
+			char bufHostName[255] = { 0 };
+			char bufService[255] = { 0 };
+			getnameinfo((const struct sockaddr *)&Request.first, Request.second, bufNumeric, sizeof(bufNumeric), NULL, 0, NI_NUMERICHOST);
+			bool bFound = (0 == getnameinfo((const struct sockaddr *)&Request.first, Request.second, bufHostName, sizeof(bufHostName), bufService, sizeof(bufService), NI_NAMEREQD));
+			Lock.lock();
+			if (bFound)
+				Names[bufNumeric] = std::string(bufHostName) + ":" + bufService;
+		}
+	}
+}
+CHostNameCache HostNames;
+// Every device is queried at the same time. Each query is a non-blocking TCP connection that the
+// main epoll loop moves along as its socket becomes ready. Each has its own deadlines, so a device
+// that has been unplugged only costs its own timeout instead of holding up everything else.
+// A power strip and its outlets are polled over a single connection to the strip.
+// The per-outlet requests are sent back to back, and the responses come back in the same order.
+const std::chrono::seconds QueryConnectTimeout(3);
+const std::chrono::seconds QueryReadTimeout(5);
+const std::chrono::seconds QueryTotalTimeout(10);
+class CKasaQuery {
+public:
+	CKasaQuery(CKasaClient* TheClient) : Socket(-1), EventPoll(-1), State(state::connecting), Reused(false), AddressGeneration(TheClient->AddressGeneration), Answered(0) { Clients.push_back(TheClient); };
+	bool Start(const int TheEventPoll);
+	bool Poll(void);	// Sends another round of requests on an idle persistent connection
+	bool Continue(const uint32_t Events);	// Returns true when the query is finished, successful or not
+	bool Idle(void) const { return(State == state::idle); };
+	size_t Unanswered(void) const { return((State == state::idle) ? 0 : Clients.size() - Answered); };	// Clients still waiting on this round
+	bool Contains(const CKasaClient* TheClient) const { return(std::find(Clients.begin(), Clients.end(), TheClient) != Clients.end()); };
+	bool Moved(void) const { return(Clients.front()->AddressGeneration != AddressGeneration); };	// The device has a new address since the connection was made
+	std::chrono::steady_clock::time_point Deadline(void) const { return(std::min(TotalDeadline, (State == state::connecting) ? ConnectDeadline : ReadDeadline)); };
+	void Close(void);
+	std::vector<CKasaClient*> Clients;	// The top level device first, followed by any outlets reached through it
+	int Socket;
+	std::string HostName;
+protected:
+	bool SendRequest(void);
+	bool SendPending(void);
+	bool Retry(void);
+	void WaitFor(const uint32_t Events);
+	void UpdateHostName(void);
+	int EventPoll;
+	enum class state { connecting, sending, receiving, idle } State;
+	bool Reused;	// The connection answered an earlier request, so a failure may just mean the device dropped it
+	unsigned int AddressGeneration;	// of the top level device when the connection was made
+	size_t Answered;	// Number of Clients whose response has arrived in this round
+	std::string Outgoing;	// Requests for this round
+	size_t OutgoingSent;	// How much of Outgoing the socket has taken so far
+	CKasaFrameReader Reader;
+	std::chrono::steady_clock::time_point ConnectDeadline;
+	std::chrono::steady_clock::time_point ReadDeadline;
+	std::chrono::steady_clock::time_point TotalDeadline;
+};
+bool CKasaQuery::Start(const int TheEventPoll)
+{
+	EventPoll = TheEventPoll;
+	State = state::connecting;
+	const CKasaClient& TheClient = *Clients.front();
+	UpdateHostName();
+	AddressGeneration = TheClient.AddressGeneration;
+	if (TheClient.ConnectAddressLength == 0)
+		return(false);
+	Socket = socket(TheClient.ConnectAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (Socket == -1)
+		return(false);
+	if ((connect(Socket, (const struct sockaddr *)&TheClient.ConnectAddress, TheClient.ConnectAddressLength) == -1) && (errno != EINPROGRESS))
+	{
+		close(Socket);
+		Socket = -1;
+		return(false);
+	}
+	auto Now = std::chrono::steady_clock::now();
+	ConnectDeadline = Now + QueryConnectTimeout;
+	ReadDeadline = Now + QueryTotalTimeout;
+	TotalDeadline = Now + QueryTotalTimeout;
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events = EPOLLOUT;	// writable once the connection completes
+	Event.data.fd = Socket;
+	epoll_ctl(EventPoll, EPOLL_CTL_ADD, Socket, &Event);
+	return(true);
+}
+bool CKasaQuery::Poll(void)
+{
+	Reused = true;
+	UpdateHostName();	// the reverse lookup may have finished since the connection was made
+	auto Now = std::chrono::steady_clock::now();
+	TotalDeadline = Now + QueryTotalTimeout;
+	return(SendRequest());
+}
+void CKasaQuery::UpdateHostName(void)
+{
+	const CKasaClient& TheClient = *Clients.front();
+	HostName = (ConsoleVerbosity > 0) ? HostNames.Lookup(TheClient) : TheClient.NumericHost;
+}
+void CKasaQuery::WaitFor(const uint32_t Events)
+{
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events = Events;
+	Event.data.fd = Socket;
+	epoll_ctl(EventPoll, EPOLL_CTL_MOD, Socket, &Event);
+}
+// Returns false if the query is finished because the requests couldn't be sent
+bool CKasaQuery::SendRequest(void)
+{
+	Outgoing.clear();
+	for (auto& Client : Clients)
+	{
+		const CKasaClient& TheClient = *Client;
+		std::string ssRequest("{\"emeter\":{\"get_realtime\":{}}}");
+		// If we are a child instead of a top level device we need to format the request with context data
+		if (!TheClient.ParentID.empty())
+		{
+			// Need to build string in the format of: '{"emeter":{"get_realtime":{}},"context":{"child_ids":["8006842B55612405D20D69504A3F43DA1B2A969406"]}}'
+			ssRequest = "{\"emeter\":{\"get_realtime\":{}},\"context\":{\"child_ids\":[\"" + TheClient.GetDeviceID() + "\"]}}";
+		}
+		uint32_t RequestLen = htonl(ssRequest.length());
+		Outgoing.append((const char *)&RequestLen, sizeof(RequestLen));
+		Outgoing.append(ssRequest.length(), '\0');
+		KasaEncrypt(ssRequest, (uint8_t *)&Outgoing[Outgoing.length() - ssRequest.length()]);
+		if (ConsoleVerbosity > 0)
+			std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] (" << ssRequest.length() + sizeof(RequestLen) << ")=> " << ssRequest << std::endl;
+	}
+	OutgoingSent = 0;
+	Answered = 0;
+	Reader.Reset();
+	ReadDeadline = std::chrono::steady_clock::now() + QueryReadTimeout;
+	return(SendPending());
+}
+// Sends as much of the outgoing requests as the socket will take, waiting for it to be writable again if it doesn't take everything
+bool CKasaQuery::SendPending(void)
+{
+	ssize_t nRet = send(Socket, Outgoing.data() + OutgoingSent, Outgoing.length() - OutgoingSent, MSG_NOSIGNAL);
+	if (nRet == -1)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			nRet = 0;
+		else if (OutgoingSent == 0)
+			return(!Retry());
+		else
+		{
+			if (ConsoleVerbosity > 0)
+				std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] send: " << strerror(errno) << std::endl;
+			return(false);
+		}
+	}
+	OutgoingSent += nRet;
+	if (OutgoingSent < Outgoing.length())
+	{
+		if (State != state::sending)
+			WaitFor(EPOLLOUT);
+		State = state::sending;
+	}
+	else
+	{
+		State = state::receiving;
+		WaitFor(EPOLLIN);
 	}
-#endif // DEBUG
-}
-/////////////////////////////////////////////////////////////////////////////
-bool ValidateDirectory(std::string& DirectoryName)
-{
-	//TODO: I want to make sure the dorectory name ends with a "/"
-	if (DirectoryName.back() != '/')
-		DirectoryName += '/';
-	//TODO: I want to make sure the dorectory exists
-	//TODO: I want to make sure the dorectory is writable by the current user
 	return(true);
 }
-std::string GenerateLogFileName(const std::string &DeviceID)
+// A persistent connection that has gone stale is replaced with a fresh one, once, without waiting for the next poll
+bool CKasaQuery::Retry(void)
 {
-	std::ostringstream OutputFilename;
-	OutputFilename << LogDirectory;
-	OutputFilename << "kasa-";
-	OutputFilename << DeviceID;
-	time_t timer;
-	time(&timer);
-	struct tm UTC;
-	if (0 != gmtime_r(&timer, &UTC))
-		if (!((UTC.tm_year == 70) && (UTC.tm_mon == 0) && (UTC.tm_mday == 1)))
-			OutputFilename << "-" << std::dec << UTC.tm_year + 1900 << "-" << std::setw(2) << std::setfill('0') << UTC.tm_mon + 1;
-	OutputFilename << ".txt";
-	return(OutputFilename.str());
+	if ((!Reused) || (Answered != 0))
+		return(true);
+	if (ConsoleVerbosity > 0)
+		std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] reconnecting" << std::endl;
+	Close();
+	Reused = false;
+	return(!Start(EventPoll));
 }
-bool GenerateLogFile(std::map<CKasaClient, std::queue<std::string>> &KasaMap)
+bool CKasaQuery::Continue(const uint32_t Events)
 {
-	bool rval = false;
-	for (auto it = KasaMap.begin(); it != KasaMap.end(); ++it)
+	if (State == state::connecting)
 	{
-		if (!it->second.empty()) // Only open the log file if there are entries to add
+		int SocketError = 0;
+		socklen_t SocketErrorLen = sizeof(SocketError);
+		getsockopt(Socket, SOL_SOCKET, SO_ERROR, &SocketError, &SocketErrorLen);
+		if (SocketError != 0)
 		{
-			std::ofstream LogFile(GenerateLogFileName(it->first.GetDeviceID()), std::ios_base::out | std::ios_base::app | std::ios_base::ate);
-			if (LogFile.is_open())
-			{
-				while (!it->second.empty())
-				{
-					LogFile << it->second.front() << std::endl;
-					it->second.pop();
-				}
-				LogFile.close();
-				rval = true;
-			}
+			if (ConsoleVerbosity > 0)
+				std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] connect: " << strerror(SocketError) << std::endl;
+			return(true);
 		}
+		return(!SendRequest());
 	}
-	return(rval);
-}
-void ReadLoggedData(const std::string& filename)
-{
-	if (ConsoleVerbosity > 0)
-		std::cout << "[" << getTimeISO8601() << "] Reading: " << filename << std::endl;
-	else
-		std::cerr << "Reading: " << filename << std::endl;
-	std::ifstream TheFile(filename);
-	if (TheFile.is_open())
+	// A connection that failed is finished now rather than at its deadline, but anything still readable is read first
+	if ((Events & EPOLLERR) || ((Events & EPOLLHUP) && !(Events & EPOLLIN)))
 	{
-		std::string TheLine;
-		while (std::getline(TheFile, TheLine))
+		int SocketError = 0;
+		socklen_t SocketErrorLen = sizeof(SocketError);
+		getsockopt(Socket, SOL_SOCKET, SO_ERROR, &SocketError, &SocketErrorLen);
+		if (ConsoleVerbosity > 0)
+			std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] connection failed: " << strerror(SocketError) << std::endl;
+		return((State == state::idle) || Retry());
+	}
+	if (State == state::sending)
+		return(!SendPending());
+	const size_t ReceiveSize = 4096;
+	ssize_t nRet = recv(Socket, Reader.WriteSpace(ReceiveSize), ReceiveSize, 0);
+	if ((nRet == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		return(false);
+	if (State == state::idle)
+	{
+		// Nothing is expected between polls, so this is the device closing its end
+		if (nRet > 0)
+			return(false);
+		if (ConsoleVerbosity > 0)
+			std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] connection closed" << std::endl;
+		return(true);
+	}
+	if (nRet <= 0)
+		return(Retry());
+	time_t ResponseTime;
+	time(&ResponseTime);	// The reading is stamped with when this device answered
+	Reader.Commit(nRet);
+	// Each complete response belongs to the next device in the order the requests were sent
+	std::string_view Response;
+	while ((Answered < Clients.size()) && Reader.Next(Response))
+	{
+		CKasaClient& TheClient = *Clients[Answered++];
+		std::ostringstream LogLine;
+		LogLine << "{\"date\":\"" << timeToExcelDate(ResponseTime) << "\",";
+		LogLine << "\"deviceId\":\"" << TheClient.GetDeviceID() << "\",";
+		LogLine << Response << "}";
+		if (ConsoleVerbosity > 0)
+			std::cout << "[" << getTimeISO8601() << "] [" << HostName << "] <=(" << Response.length() + sizeof(uint32_t) << ") " << Response << std::endl;
+		// Parsing and storing happen on the aggregator thread, polling never waits for them
+		if (!PolledQueue.Push({ CPolledMessage::kind::reading, TheClient.GetDeviceID(), LogLine.str() }))
 		{
-			CKASAReading theReading(TheLine);
-			if (theReading.IsValid())
-				UpdateMRTGData(theReading.GetDeviceID(), theReading);
+			PolledDropped++;
+			std::cerr << "[" << getTimeISO8601() << "] [" << HostName << "] reading queue full, dropped reading for " << TheClient.GetDeviceID() << std::endl;
 		}
-		TheFile.close();
 	}
+	if (Reader.Malformed() && (Answered < Clients.size()))
+	{
+		// The connection can't be trusted to be in step any more, the next poll starts a fresh one
+		std::cerr << "[" << getTimeISO8601() << "] [" << HostName << "] malformed response for " << Clients[Answered]->GetDeviceID() << ", length " << Reader.MalformedLength() << std::endl;
+		return(true);
+	}
+	if (Answered < Clients.size())
+		return(false);
+	if (!PersistentConnections)
+		return(true);
+	State = state::idle;
+	WaitFor(EPOLLIN | EPOLLRDHUP);
+	return(false);
 }
-// Finds log files specific to this program then reads the contents into the memory mapped structure simulating MRTG log files.
-void ReadLoggedData(void)
+void CKasaQuery::Close(void)
 {
-	DIR* dp;
-	if ((dp = opendir(LogDirectory.c_str())) != NULL)
+	if (Socket != -1)
 	{
-		std::deque<std::string> files;
-		struct dirent* dirp;
-		while ((dirp = readdir(dp)) != NULL)
-			if (DT_REG == dirp->d_type)
-			{
-				std::string filename = LogDirectory + std::string(dirp->d_name);
-				if ((filename.substr(LogDirectory.size(), 4) == "kasa") && (filename.substr(filename.size() - 4, 4) == ".txt"))
-				{
-					auto fullname = realpath(filename.c_str(), NULL);
-					if (fullname != NULL)
-					{
-						filename = fullname;
-						free(fullname);
-					}
-					files.push_back(filename);
-				}
-			}
-		closedir(dp);
-		if (!files.empty())
+		epoll_ctl(EventPoll, EPOLL_CTL_DEL, Socket, NULL);
+		close(Socket);
+		Socket = -1;
+	}
+}
+// A query that had to reconnect has a new socket, and the map is keyed by socket
+void RekeyQuery(std::map<int, CKasaQuery>& KasaQueries, std::map<int, CKasaQuery>::iterator Query)
+{
+	if (Query->first != Query->second.Socket)
+	{
+		auto Node = KasaQueries.extract(Query);
+		Node.key() = Node.mapped().Socket;
+		KasaQueries.insert(std::move(Node));
+	}
+}
+// Start a query to each device for its energy usage, the responses are logged and recorded as they arrive
+void QueryClients(std::unordered_map<std::string, CKasaClient>& KasaClients, const int EventPoll, std::map<int, CKasaQuery>& KasaQueries)
+{
+	for (auto it = KasaClients.begin(); it != KasaClients.end(); ++it)
+	{
+		if (!it->second.ParentID.empty())
+			continue;	// outlets are polled along with their strip
+		CKasaClient* TheClient = &it->second;
+		auto Query = KasaQueries.begin();
+		while ((Query != KasaQueries.end()) && (Query->second.Clients.front() != TheClient))
+			++Query;
+		if ((Query != KasaQueries.end()) && Query->second.Idle() && Query->second.Moved())
+		{
+			// The connection kept open goes to the device's old address, the new one gets a fresh connection
+			if (ConsoleVerbosity > 0)
+				std::cout << "[" << getTimeISO8601() << "] [" << Query->second.HostName << "] moved to " << TheClient->NumericHost << ", reconnecting" << std::endl;
+			Query->second.Close();
+			KasaQueries.erase(Query);
+			Query = KasaQueries.end();
+		}
+		if (Query == KasaQueries.end())
 		{
-			sort(files.begin(), files.end());
-			while (!files.empty())
+			CKasaQuery NewQuery(TheClient);
+			for (auto& ChildID : TheClient->Children)
+				NewQuery.Clients.push_back(&KasaClients.at(ChildID));
+			KasaPolls += NewQuery.Clients.size();
+			if (NewQuery.Start(EventPoll))
+				KasaQueries.insert(std::pair<int, CKasaQuery>(NewQuery.Socket, NewQuery));
+			else
+				KasaPollFailures += NewQuery.Clients.size();
+		}
+		else if (Query->second.Idle())
+		{
+			// Outlets discovered since the connection was opened join it
+			for (auto& ChildID : TheClient->Children)
+				if (!Query->second.Contains(&KasaClients.at(ChildID)))
+					Query->second.Clients.push_back(&KasaClients.at(ChildID));
+			KasaPolls += Query->second.Clients.size();
+			if (!Query->second.Poll())
 			{
-				ReadLoggedData(*files.begin());
-				files.pop_front();
+				KasaPollFailures += Query->second.Clients.size();
+				Query->second.Close();
+				KasaQueries.erase(Query);
 			}
+			else
+				RekeyQuery(KasaQueries, Query);
 		}
 	}
 }
-/////////////////////////////////////////////////////////////////////////////
-void GetMRTGOutput(const std::string &DeviceID, const int Minutes = 5)
+// Closes any queries that have passed one of their deadlines, returning the milliseconds until the next deadline or -1 if there are none
+int ExpireQueries(std::map<int, CKasaQuery>& KasaQueries)
 {
-	// HACK: This next bit of getting the time formatted the same way I log it and 
-	// then converting it back to a time_t is a workaround for behavior I 
-	// currently do not understand and don't want to spend further time on now.
-	std::string ISOCurrentTime(getTimeISO8601());
-	time_t now = ISO8601totime(ISOCurrentTime);
-	std::ifstream TheFile(GenerateLogFileName(DeviceID));
-	if (TheFile.is_open())
+	auto Now = std::chrono::steady_clock::now();
+	for (auto it = KasaQueries.begin(); it != KasaQueries.end();)
 	{
-		std::queue<std::string> LogLines;
-		TheFile.seekg(0, std::ios_base::end);      //Start at end of file
-		do 
+		if ((!it->second.Idle()) && (it->second.Deadline() <= Now))
 		{
-			char ch = ' ';                             //Init ch not equal to '\n'
-			while (ch != '\n')
-			{
-				TheFile.seekg(-2, std::ios_base::cur); //Two steps back, this means we will NOT check the last character
-				if ((int)TheFile.tellg() <= 0)         //If passed the start of the file,
-				{
-					TheFile.seekg(0);                  //this is the start of the file
-					break;
-				}
-				TheFile.get(ch);                       //Check the next character
-			}
-			auto FileStreamPos = TheFile.tellg(); // Save Current Stream Position
-			std::string TheLine;
-			std::getline(TheFile, TheLine);
-			auto pos = TheLine.find("\"date\"");
-			if (pos != std::string::npos)
-			{
-				// HACK: I need to clean this up..  
-				std::string Value(TheLine.substr(pos));	// value starts at key
-				Value.erase(Value.find_first_of(",}"));	// truncate value
-				Value.erase(0, Value.find(':'));	// move past key value
-				Value.erase(Value.find(':'), 1);	// move past seperator
-				Value.erase(Value.find('"'), 1);	// erase leading quote
-				Value.erase(Value.find('"'), 1);	// erase trailing quote
-				time_t DataTime = ISO8601totime(Value);
-				if ((Minutes == 0) && LogLines.empty()) // HACK: Special Case to always accept the last logged value
-					LogLines.push(TheLine);
-				if ((Minutes * 60.0) < difftime(now, DataTime))	// If this entry is more than Minutes parameter from current time, it's time to stop reading log file.
-					break;
-				LogLines.push(TheLine);
-			}
-			TheFile.seekg(FileStreamPos);	// Move Stream position to where it was before reading TheLine
-		} while (TheFile.tellg() > 0);	// If we are at the beginning of the file, there's nothing more to do
-		TheFile.close();
-
-		if (!LogLines.empty())	// Only return data if we've recieved data in the last 5 minutes
-		{
-			long long NumElements = LogLines.size();
-			double power = 0;
-			double voltage = 0;
-			long long power_mw = 0;
-			long long voltage_mv = 0;
-			while (!LogLines.empty())
-			{
-				std::string TheLine(LogLines.front());
-				LogLines.pop();
-				auto pos = TheLine.find("\"power\"");
-				if (pos != std::string::npos)
-				{
-					// HACK: I need to clean this up..  
-					std::string Value(TheLine.substr(pos));	// value starts at key
-					Value.erase(Value.find_first_of(",}"));	// truncate value
-					Value.erase(0, Value.find(':'));	// move past key value
-					Value.erase(Value.find(':'), 1);	// move past seperator
-					power += std::stod(Value.c_str());
-				}
-
-				pos = TheLine.find("\"voltage\"");
-				if (pos != std::string::npos)
-				{
-					// HACK: I need to clean this up..  
-					std::string Value(TheLine.substr(pos));	// value starts at key
-					Value.erase(Value.find_first_of(",}"));	// truncate value
-					Value.erase(0, Value.find(':'));	// move past key value
-					Value.erase(Value.find(':'), 1);	// move past seperator
-					voltage += std::stod(Value.c_str());
-				}
-
-				pos = TheLine.find("\"power_mw\"");
-				if (pos != std::string::npos)
-				{
-					// HACK: I need to clean this up..  
-					std::string Value(TheLine.substr(pos));	// value starts at key
-					Value.erase(Value.find_first_of(",}"));	// truncate value
-					Value.erase(0, Value.find(':'));	// move past key value
-					Value.erase(Value.find(':'), 1);	// move past seperator
-					power_mw += std::stol(Value);
-				}
-
-				pos = TheLine.find("\"voltage_mv\"");
-				if (pos != std::string::npos)
-				{
-					// HACK: I need to clean this up..  
-					std::string Value(TheLine.substr(pos));	// value starts at key
-					Value.erase(Value.find_first_of(",}"));	// truncate value
-					Value.erase(0, Value.find(':'));	// move past key value
-					Value.erase(Value.find(':'), 1);	// move past seperator
-					voltage_mv += std::stol(Value);
-				}
-			}
-			// Initial Averaging of data may have overflow issues that need to be fixed. 
-			// For possible solution see https://www.geeksforgeeks.org/compute-average-two-numbers-without-overflow/ 
-			// But it would be better to use a combination with https://www.geeksforgeeks.org/average-of-a-stream-of-numbers/
-			power /= double(NumElements);
-			voltage /= double(NumElements);
-			power_mw /= NumElements;
-			voltage_mv /= NumElements;
-
-			std::cout << std::dec; // make sure I'm putting things in decimal format
-			if (power_mw != 0)
-				std::cout << power_mw << std::endl; // current state of the second variable, normally 'outgoing bytes count'
-			else
-				std::cout << std::fixed << power * 1000.0 << std::endl; // current state of the second variable, normally 'outgoing bytes count'
-			if (voltage_mv != 0)
-				std::cout << voltage_mv << std::endl; // current state of the first variable, normally 'incoming bytes count'
-			else
-				std::cout << std::fixed << voltage * 1000.0 << std::endl; // current state of the first variable, normally 'incoming bytes count'
-			std::cout << " " << std::endl; // string (in any human readable format), uptime of the target.
-			std::cout << DeviceID << std::endl; // string, name of the target.
+			if (ConsoleVerbosity > 0)
+				std::cout << "[" << getTimeISO8601() << "] [" << it->second.HostName << "] timed out" << std::endl;
+			KasaPollFailures += it->second.Unanswered();
+			it->second.Close();
+			it = KasaQueries.erase(it);
+		}
+		else
+			++it;
+	}
+	int rval = -1;
+	for (auto& Query : KasaQueries)
+	{
+		if (!Query.second.Idle())
+		{
+			auto Remaining = std::chrono::duration_cast<std::chrono::milliseconds>(Query.second.Deadline() - Now).count() + 1;
+			if ((rval == -1) || (Remaining < rval))
+				rval = int(Remaining);
 		}
 	}
+	return(rval);
 }
 /////////////////////////////////////////////////////////////////////////////
-volatile bool bRun = true; // This is declared volatile so that the compiler won't optimize it out of loops later in the code
-void SignalHandlerSIGINT(int signal)
+// Times the hot paths against the straightforward byte at a time versions they replaced, using
+// payloads shaped like the sysinfo responses devices send, from a single plug up to a power strip.
+void KasaEncryptBytewise(const std::string &input, uint8_t * output)
 {
-	bRun = false;
-	std::cerr << "***************** SIGINT: Caught Ctrl-C, finishing loop and quitting. *****************" << std::endl;
+	uint8_t key = 0xAB;
+	for (auto it = input.begin(); it != input.end(); it++)
+	{
+		uint8_t a = key ^ *it;
+		key = a;
+		*output++ = a;
+	}
 }
-void SignalHandlerSIGHUP(int signal)
+void KasaDecryptBytewise(const size_t len, const uint8_t input[], std::string &output)
 {
-	bRun = false;
-	std::cerr << "***************** SIGHUP: Caught HangUp, finishing loop and quitting. *****************" << std::endl;
+	output.clear();
+	output.reserve(len);
+	uint8_t key = 0xAB;
+	for (size_t index = 0; index < len; index++)
+	{
+		uint8_t a = key ^ input[index];
+		key = input[index];
+		output += a;
+	}
+}
+template <typename Function>
+double BenchmarkNanoseconds(const size_t Iterations, Function TheFunction)
+{
+	auto Start = std::chrono::steady_clock::now();
+	for (size_t Iteration = 0; Iteration < Iterations; Iteration++)
+		TheFunction();
+	return(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count() / Iterations);
+}
+void Benchmark(void)
+{
+	const std::string Sysinfo("{\"system\":{\"get_sysinfo\":{\"sw_ver\":\"1.0.12 Build 200707 Rel.104839\",\"hw_ver\":\"1.0\",\"model\":\"HS300(US)\",\"deviceId\":\"8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D\",\"oemId\":\"5C9E6254BEBAED63B2B6102966D24C17\",\"hwId\":\"34C41AA028022D0CCEA5E678E8547C54\",\"rssi\":-45,\"latitude_i\":0,\"longitude_i\":0,\"alias\":\"Power Strip\",\"status\":\"new\",\"mic_type\":\"IOT.SMARTPLUGSWITCH\",\"feature\":\"TIM:ENE\",\"mac\":\"B0:A7:B9:00:00:00\",\"updating\":0,\"led_off\":0,\"children\":[");
+	const std::string Child("{\"id\":\"8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D00\",\"state\":1,\"alias\":\"Outlet\",\"on_time\":3600,\"next_action\":{\"type\":-1}},");
+	std::string Source(Sysinfo);
+	while (Source.length() < 8192)
+		Source += Child;
+	std::cout << "Encrypt and decrypt, nanoseconds per message" << std::endl;
+	std::cout << std::setw(8) << "bytes" << std::setw(16) << "encrypt before" << std::setw(16) << "encrypt after" << std::setw(16) << "decrypt before" << std::setw(16) << "decrypt after" << std::endl;
+	for (auto Length : { 100, 512, 2048, 8192 })
+	{
+		const std::string Plain(Source.substr(0, Length));
+		const size_t Iterations = 4 * 1024 * 1024 / Length;
+		std::vector<uint8_t> Expected(Plain.length()), Encrypted(Plain.length()), Work(Plain.length());
+		KasaEncryptBytewise(Plain, Expected.data());
+		KasaEncrypt(Plain, Encrypted.data());
+		Work = Encrypted;
+		if ((Encrypted != Expected) || (KasaDecrypt(Work.data(), Work.size()) != Plain))
+			std::cerr << "Mismatch at " << Length << " bytes" << std::endl;
+		std::string Decrypted;
+		double EncryptBefore = BenchmarkNanoseconds(Iterations, [&]() { KasaEncryptBytewise(Plain, Encrypted.data()); });
+		double EncryptAfter = BenchmarkNanoseconds(Iterations, [&]() { KasaEncrypt(Plain, Encrypted.data()); });
+		double DecryptBefore = BenchmarkNanoseconds(Iterations, [&]() { KasaDecryptBytewise(Encrypted.size(), Encrypted.data(), Decrypted); });
+		// The in place version works on a fresh copy each time, as it would on a receive buffer, so the copy is included
+		double DecryptAfter = BenchmarkNanoseconds(Iterations, [&]() { memcpy(Work.data(), Encrypted.data(), Encrypted.size()); KasaDecrypt(Work.data(), Work.size()); });
+		std::cout << std::setw(8) << Length << std::fixed << std::setprecision(1) << std::setw(16) << EncryptBefore << std::setw(16) << EncryptAfter << std::setw(16) << DecryptBefore << std::setw(16) << DecryptAfter << std::endl;
+	}
+	// A day of made up readings, rendered into a scratch directory the way WriteAllSVG would
+	char ScratchDirectory[] = "/tmp/kasaenergylogger-XXXXXX";
+	if (NULL != mkdtemp(ScratchDirectory))
+	{
+		std::vector<CKASAReading> TheValues;
+		time_t SampleTime = (time(NULL) / DAY_SAMPLE) * DAY_SAMPLE;
+		for (size_t index = 0; index < DAY_COUNT; index++)
+		{
+			std::ostringstream LogLine;
+			LogLine << "{\"date\":\"" << timeToExcelDate(SampleTime) << "\",\"deviceId\":\"BENCHMARK\",{\"emeter\":{\"get_realtime\":{";
+			LogLine << "\"voltage_mv\":" << 119000 + (index * 37) % 2000 << ",\"current_ma\":" << 200 + (index * 53) % 900 << ",\"power_mw\":" << 24000 + (index * 9973) % 90000 << ",\"total_wh\":" << 5000 + index << ",\"err_code\":0}}}}";
+			TheValues.push_back(CKASAReading(LogLine.str()));
+			SampleTime -= DAY_SAMPLE;
+		}
+		const std::string SVGFileName(std::string(ScratchDirectory) + "/kasa-BENCHMARK-day.svg");
+		auto ErrorBuffer = std::cerr.rdbuf(NULL);	// WriteSVG announces every file it writes
+		auto Verbosity = ConsoleVerbosity;
+		ConsoleVerbosity = 0;
+		double Plain = BenchmarkNanoseconds(1000, [&]() { WriteSVG(TheValues, SVGFileName, "Benchmark", GraphType::daily, false, false); });
+		double Detailed = BenchmarkNanoseconds(1000, [&]() { WriteSVG(TheValues, SVGFileName, "Benchmark", GraphType::daily, true, true); });
+		ConsoleVerbosity = Verbosity;
+		std::cerr.rdbuf(ErrorBuffer);
+		std::cerr.clear();
+		std::cout << "Daily graph, microseconds per file" << std::endl;
+		std::cout << std::setw(16) << "plain" << std::setw(16) << "minmax + WH" << std::endl;
+		std::cout << std::setw(16) << Plain / 1000 << std::setw(16) << Detailed / 1000 << std::endl;
+		unlink(SVGFileName.c_str());
+		rmdir(ScratchDirectory);
+	}
 }
 /////////////////////////////////////////////////////////////////////////////
 int LogFileTime = 120;
@@ -1218,12 +4234,23 @@ static void usage(int argc, char **argv)
 	std::cout << "    -v | --verbose level stdout verbosity level [" << ConsoleVerbosity << "]" << std::endl;
 	std::cout << "    -r | --runtime seconds time to run before quitting [" << RunTime << "]" << std::endl;
 	std::cout << "    -m | --mrtg 8006D28F7D6C1FC75E7254E4D10B1D1219A9B81D Get last value for this deviceId" << std::endl;
+	std::cout << "                         May be repeated, and \"all\" answers for every device logged this month" << std::endl;
+	std::cout << "    -n | --shm name      Shared memory for live readings, read by --mrtg, empty for none [" << LiveStateName << "]" << std::endl;
+	std::cout << "    -o | --mrtgdir name  Write each --mrtg answer to name/kasa-deviceId.mrtg instead of stdout" << std::endl;
 	std::cout << "    -s | --svg name      SVG output directory" << std::endl;
 	std::cout << "    -x | --minmax graph  Draw the minimum and maximum temperature and humidity status on SVG graphs. 1:daily, 2:weekly, 4:monthly, 8:yearly" << std::endl;
 	std::cout << "    -w | --watthour graph Display the total watt hours on SVG graphs. 1:daily, 2:weekly, 4:monthly, 8:yearly" << std::endl;
+	std::cout << "    -z | --gzip          Also write each SVG file compressed, as .svg.gz for web servers that serve precompressed files" << std::endl;
+	std::cout << "    -j | --jobs count    Threads rendering SVG graphs, 0 for one per processor [" << SVGThreadCount << "]" << std::endl;
+	std::cout << "    -g | --http [address:]port Serve graphs, readings, and /metrics over HTTP, on loopback unless an address is given" << std::endl;
+	std::cout << "    -p | --persistent    Keep a connection open to each device between polls" << std::endl;
+	std::cout << "    -e | --segments      Log readings to binary .seg segments instead of .txt files" << std::endl;
+	std::cout << "    -c | --convert       Convert the .txt logs in the logging directory to .seg segments, then exit" << std::endl;
+	std::cout << "    -k | --compress      Gzip each .txt log once its month is over, as .txt.gz" << std::endl;
+	std::cout << "    -b | --benchmark     Time the protocol and output routines, then exit" << std::endl;
 	std::cout << std::endl;
 }
-static const char short_options[] = "hl:t:v:r:m:s:x:w:";
+static const char short_options[] = "hl:t:v:r:m:o:n:s:x:w:zj:g:peckb";
 static const struct option long_options[] = {
 		{ "help",   no_argument,       NULL, 'h' },
 		{ "log",    required_argument, NULL, 'l' },
@@ -1231,16 +4258,28 @@ static const struct option long_options[] = {
 		{ "verbose",required_argument, NULL, 'v' },
 		{ "runtime",required_argument, NULL, 'r' },
 		{ "mrtg",   required_argument, NULL, 'm' },
+		{ "mrtgdir",	required_argument, NULL, 'o' },
+		{ "shm",	required_argument, NULL, 'n' },
 		{ "svg",	required_argument, NULL, 's' },
 		{ "minmax",	required_argument, NULL, 'x' },
 		{ "watthour",	required_argument, NULL, 'w' },
+		{ "gzip",	no_argument,       NULL, 'z' },
+		{ "jobs",	required_argument, NULL, 'j' },
+		{ "http",	required_argument, NULL, 'g' },
+		{ "persistent",	no_argument,       NULL, 'p' },
+		{ "segments",	no_argument,       NULL, 'e' },
+		{ "convert",	no_argument,       NULL, 'c' },
+		{ "compress",	no_argument,       NULL, 'k' },
+		{ "benchmark",	no_argument,       NULL, 'b' },
 		{ 0, 0, 0, 0 }
 };
 /////////////////////////////////////////////////////////////////////////////
 int main(int argc, char **argv)
 {
 	///////////////////////////////////////////////////////////////////////////////////////////////
-	std::string MRTGAddress;
+	std::vector<std::string> MRTGDevices;
+	std::string MRTGDirectory;
+	bool bConvert = false;
 	for (;;)
 	{
 		int idx;
@@ -1273,7 +4312,17 @@ int main(int argc, char **argv)
 			catch (const std::out_of_range& oor) { std::cerr << "Out of Range error: " << oor.what() << std::endl; exit(EXIT_FAILURE); }
 			break;
 		case 'm':
-			MRTGAddress = std::string(optarg);
+			MRTGDevices.push_back(std::string(optarg));
+			break;
+		case 'n':
+			LiveStateName = std::string(optarg);
+			if (!LiveStateName.empty() && (LiveStateName.front() != '/'))
+				LiveStateName.insert(0, 1, '/');
+			break;
+		case 'o':
+			MRTGDirectory = std::string(optarg);
+			if (!ValidateDirectory(MRTGDirectory))
+				MRTGDirectory.clear();
 			break;
 		case 's':
 			SVGDirectory = std::string(optarg);
@@ -1290,15 +4339,47 @@ int main(int argc, char **argv)
 			catch (const std::invalid_argument& ia) { std::cerr << "Invalid argument: " << ia.what() << std::endl; exit(EXIT_FAILURE); }
 			catch (const std::out_of_range& oor) { std::cerr << "Out of Range error: " << oor.what() << std::endl; exit(EXIT_FAILURE); }
 			break;
+		case 'z':
+			SVGGzip = true;
+			break;
+		case 'j':
+			try { SVGThreadCount = std::stoi(optarg); }
+			catch (const std::invalid_argument& ia) { std::cerr << "Invalid argument: " << ia.what() << std::endl; exit(EXIT_FAILURE); }
+			catch (const std::out_of_range& oor) { std::cerr << "Out of Range error: " << oor.what() << std::endl; exit(EXIT_FAILURE); }
+			break;
+		case 'g':
+			HTTPAddress = std::string(optarg);
+			break;
+		case 'p':
+			PersistentConnections = true;
+			break;
+		case 'e':
+			LogSegments = true;
+			break;
+		case 'c':
+			bConvert = true;
+			break;
+		case 'k':
+			LogCompress = true;
+			break;
+		case 'b':
+			Benchmark();
+			exit(EXIT_SUCCESS);
 		default:
 			usage(argc, argv);
 			exit(EXIT_FAILURE);
 		}
 	}
 	///////////////////////////////////////////////////////////////////////////////////////////////
-	if (!MRTGAddress.empty())
+	if (bConvert)
+	{
+		ConvertLogsToSegments();
+		exit(EXIT_SUCCESS);
+	}
+	///////////////////////////////////////////////////////////////////////////////////////////////
+	if (!MRTGDevices.empty())
 	{
-		GetMRTGOutput(MRTGAddress);
+		GetMRTGOutput(MRTGDevices, MRTGDirectory);
 		exit(EXIT_SUCCESS);
 	}
 	///////////////////////////////////////////////////////////////////////////////////////////////
@@ -1348,371 +4429,200 @@ int main(int argc, char **argv)
 	time(&StartTime);
 	time_t CurrentTime;
 	time(&CurrentTime);
-	time_t LastQueryTime = 0;
-	time_t LastBroadcastTime = 0;
-	time_t LastLogTime = 0;
-	time_t DisplayTime = 0;
-	time_t TimeSVG = 0;
 	std::vector<struct sockaddr> BroadcastAddresses;
-	std::map<CKasaClient, std::queue<std::string>> KasaClients;
+	std::unordered_map<std::string, CKasaClient> KasaClients;	// Every device being polled, keyed by DeviceID
 
 	ReadLoggedData();
+	if (!LiveStateName.empty())
+	{
+		if (LiveState.Create(LiveStateName))
+			for (auto& Log : KasaMRTGLogs)
+				LiveState.Publish(Log.first, Log.second);
+		else
+			std::cerr << "[" << getTimeISO8601() << "] unable to create shared memory " << LiveStateName << ": " << strerror(errno) << std::endl;
+	}
+
+	if (!SVGDirectory.empty())
+	{
+		size_t ThreadCount = SVGThreadCount > 0 ? SVGThreadCount : std::thread::hardware_concurrency();
+		SVGThreads.Start(ThreadCount > 0 ? ThreadCount : 1);
+	}
+	if (LogCompress)
+	{
+		CompressThreads.Start(1);
+		CompressFinishedLogs();	// months that ended while the program wasn't running
+	}
+	std::thread Aggregator(AggregatorThread);
+	std::thread Writer(WriterThread);
+
+	// Everything the main loop does is driven by epoll: the discovery socket becoming
+	// readable, or one of the timers expiring. Nothing runs while there's nothing to do.
+	int EventPoll = epoll_create1(EPOLL_CLOEXEC);
+	auto AddEvent = [EventPoll](const int FileDescriptor)
+	{
+		struct epoll_event Event;
+		memset(&Event, 0, sizeof(Event));
+		Event.events = EPOLLIN;
+		Event.data.fd = FileDescriptor;
+		epoll_ctl(EventPoll, EPOLL_CTL_ADD, FileDescriptor, &Event);
+	};
+	// Periodic timers fire immediately and then every Interval seconds
+	auto AddTimer = [AddEvent](const time_t Interval)
+	{
+		int TimerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct itimerspec TimerSpec;
+		memset(&TimerSpec, 0, sizeof(TimerSpec));
+		TimerSpec.it_value.tv_nsec = 1;
+		TimerSpec.it_interval.tv_sec = Interval;
+		timerfd_settime(TimerDescriptor, 0, &TimerSpec, NULL);
+		AddEvent(TimerDescriptor);
+		return(TimerDescriptor);
+	};
+	// Clears a timer that has fired so epoll stops reporting it
+	auto TimerExpired = [](const int TimerDescriptor)
+	{
+		uint64_t Expirations = 0;
+		return(sizeof(Expirations) == read(TimerDescriptor, &Expirations, sizeof(Expirations)));
+	};
+	const int BroadcastTimer = (ServerListenSocket != -1) ? AddTimer(300) : -1;
+	const int QueryTimer = AddTimer(60);
+	const int LogTimer = AddTimer(std::max(LogFileTime, 1));
+	const int DisplayTimer = (ConsoleVerbosity > 0) ? AddTimer(1) : -1;
+	// SVG files are written right away and then lined up on the five minute period, so they use the wall clock
+	const int SVGTimer = SVGDirectory.empty() ? -1 : timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	auto ArmSVGTimer = [SVGTimer](const time_t When)
+	{
+		struct itimerspec TimerSpec;
+		memset(&TimerSpec, 0, sizeof(TimerSpec));
+		TimerSpec.it_value.tv_sec = When;
+		TimerSpec.it_value.tv_nsec = (When == 0) ? 1 : 0;
+		timerfd_settime(SVGTimer, (When == 0) ? 0 : TFD_TIMER_ABSTIME, &TimerSpec, NULL);
+	};
+	if (SVGTimer != -1)
+	{
+		ArmSVGTimer(0);
+		AddEvent(SVGTimer);
+	}
+	const int RunTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (RunTime != INT_MAX)	// the default runs forever, and a 32 bit time_t can't hold INT_MAX + 1
+	{
+		struct itimerspec RunTimeSpec;
+		memset(&RunTimeSpec, 0, sizeof(RunTimeSpec));
+		RunTimeSpec.it_value.tv_sec = time_t(RunTime) + 1;
+		timerfd_settime(RunTimer, 0, &RunTimeSpec, NULL);
+	}
+	AddEvent(RunTimer);
+	if (ServerListenSocket != -1)
+	{
+		// If we are listening for UDP messages on port 9999, we want to broadcast the fact.
+		GetBroadcastAddresses(BroadcastAddresses);
+		AddEvent(ServerListenSocket);
+	}
+	CHTTPServer HTTPServer;
+	if (!HTTPAddress.empty())
+	{
+		if (HTTPServer.Listen(HTTPAddress, EventPoll))
+			AddEvent(ResponseQueue.WaitDescriptor());
+		else
+			std::cerr << "[" << getTimeISO8601() << "] unable to listen for HTTP on " << HTTPAddress << std::endl;
+	}
+
+	std::map<int, CKasaQuery> KasaQueries;	// device queries in flight, keyed by their socket
 
 	// Loop until we get a Ctrl-C
 	while (bRun)
 	{
+		struct epoll_event Events[16];
+		int EventCount = epoll_wait(EventPoll, Events, sizeof(Events) / sizeof(Events[0]), ExpireQueries(KasaQueries));
+		if (EventCount == -1)
+		{
+			if (errno != EINTR)	// signals interrupt the wait, and bRun will have been cleared
+			{
+				perror("epoll_wait");
+				bRun = false;
+			}
+			continue;
+		}
 		time(&CurrentTime);
-		if (ServerListenSocket != -1)
+		for (auto index = 0; index < EventCount; index++)
 		{
-			// If we are listening for UDP messages on port 9999, we want to broadcast the fact.
-			//static std::vector<in_addr> BroadcastAddresses;
-			// Fill the list of proper broadcast addresses
-			if (BroadcastAddresses.empty())
+			const int FileDescriptor = Events[index].data.fd;
+			if (FileDescriptor == ServerListenSocket)
+				ReceiveDiscovery(ServerListenSocket, KasaClients, CurrentTime);	// Always check for UDP Messages
+			else if (FileDescriptor == BroadcastTimer)
 			{
-				struct ifaddrs *ifaddr = NULL;
-				if (getifaddrs(&ifaddr) != -1)
-				{
-					for (auto ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
-					{
-						if (ifa->ifa_addr != NULL)
-						{
-							int family = ifa->ifa_addr->sa_family;
-							if (ConsoleVerbosity > 0)
-							{
-								std::cout << ifa->ifa_name;
-								std::cout << "\t" << ((family == AF_PACKET) ? "AF_PACKET" : (family == AF_INET) ? "AF_INET" : (family == AF_INET6) ? "AF_INET6" : "???");
-								std::cout << " (" << family << ")";
-							}
-							if (family == AF_INET || family == AF_INET6)
-							{
-								char host[NI_MAXHOST] = { 0 };
-								if (0 == getnameinfo(ifa->ifa_addr,
-									(family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-									host, NI_MAXHOST,
-									NULL, 0, NI_NUMERICHOST))
-								{
-									if (ConsoleVerbosity > 0)
-										std::cout << "\taddress: " << host;
-								}
-								host[0] =  0;
-								if (0 == getnameinfo(ifa->ifa_ifu.ifu_broadaddr,
-									(family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-									host, NI_MAXHOST,
-									NULL, 0, NI_NUMERICHOST))
-								{
-									if (ConsoleVerbosity > 0)
-										std::cout << "\tbroadcast: " << host;
-									BroadcastAddresses.push_back(*ifa->ifa_ifu.ifu_broadaddr);
-								}
-
-								//if (ifa->ifa_flags & IFF_BROADCAST )
-								//in_addr baddr = ifa->ifa_ifu.ifu_broadaddr;
-								//std::cout << inet_ntoa(baddr) << std::endl;
-								//BroadcastAddresses.push_back(baddr);
-							}
-							if (ConsoleVerbosity > 0)
-								std::cout << std::endl;
-							//else if (family == AF_PACKET && ifa->ifa_data != NULL) 
-							//{
-							//	struct rtnl_link_stats *stats = (struct rtnl_link_stats *) ifa->ifa_data;
-							//	std::cout << "\t\ttx_packets = " << stats->tx_packets;
-							//	std::cout << " rx_packets = " << stats;
-							//	printf("\t\ttx_packets = %10u; rx_packets = %10u\n"
-							//		"\t\ttx_bytes   = %10u; rx_bytes   = %10u\n",
-							//		stats->tx_packets, stats->rx_packets,
-							//		stats->tx_bytes, stats->rx_bytes);
-							//}
-						}
-					}
-				}
-				freeifaddrs(ifaddr);
-
-				if (BroadcastAddresses.empty())
-				{
-					// https://beej.us/guide/bgnet/html/#structs
-					struct sockaddr sa;
-					struct sockaddr_in * sa4 = (struct sockaddr_in *)&sa;
-					memset(&sa, '\0', sizeof(sockaddr));
-					sa4->sin_family = AF_INET;
-					if (1 == inet_pton(AF_INET, "255.255.255.255", &(sa4->sin_addr)))
-						BroadcastAddresses.push_back(sa);
-				}
+				if (TimerExpired(BroadcastTimer))	// periodically brodcast a UDP Query
+					BroadcastDiscovery(ServerListenSocket, BroadcastAddresses);
 			}
-
-			// periodically brodcast a UDP Query
-			if (difftime(CurrentTime, LastBroadcastTime) > 299)
+			else if (FileDescriptor == QueryTimer)
 			{
-				LastBroadcastTime = CurrentTime;
-				//for each (in_addr Address in BroadcastAddresses)
-				// Broadcast our message
-				for (auto Address : BroadcastAddresses)
+				if (TimerExpired(QueryTimer))
 				{
-					if (Address.sa_family == AF_INET)
-					{
-						const std::string KasaSysinfo("{\"system\":{\"get_sysinfo\":{}}}");	// Get System Info (Software & Hardware Versions, MAC, deviceID, hwID etc.)
-						auto bufferlen = KasaSysinfo.length();
-						uint8_t buffer[256] = { 0 };
-						KasaEncrypt(KasaSysinfo, buffer);
-						struct sockaddr_in *sin = (struct sockaddr_in *) &Address;
-						struct sockaddr_in saBroadCast;
-						saBroadCast.sin_family = AF_INET;
-						saBroadCast.sin_addr = sin->sin_addr;
-						saBroadCast.sin_port = htons(9999);	// Port number
-						sendto(ServerListenSocket,			// Socket
-							buffer,							// Data buffer
-							bufferlen,						// Length of data
-							0,								// Flags
-							(const struct sockaddr *)&saBroadCast,		// Server address
-							sizeof(struct sockaddr));		// Length of address
-						if (ConsoleVerbosity > 0)
-						{
-							char BroadcastName[INET6_ADDRSTRLEN] = { 0 };
-							struct sockaddr_in* foo = (struct sockaddr_in*)&saBroadCast;
-							inet_ntop(saBroadCast.sin_family, &(foo->sin_addr), BroadcastName, INET6_ADDRSTRLEN);
-							std::cout << "[" << getTimeISO8601() << "] broadcast (" << BroadcastName << ") : " << KasaSysinfo << std::endl;
-						}
-					}
+					QueryClients(KasaClients, EventPoll, KasaQueries);
+					HTTPServer.Expire(CurrentTime);
 				}
 			}
-			// Recieve any reponses
-			uint8_t szBuf[8192];
-			struct sockaddr sa;
-			socklen_t sa_len = sizeof(struct sockaddr);
-			ssize_t nRet = 0;
-			// Always check for UDP Messages
-			while ((nRet = recvfrom(ServerListenSocket, szBuf, sizeof(szBuf), 0, &sa, &sa_len)) > 0)
+			else if (FileDescriptor == LogTimer)
 			{
-				std::string ClientResponse;
-				KasaDecrypt(nRet, szBuf, ClientResponse);
-				char ClientHostname[INET6_ADDRSTRLEN] = { 0 };
-				if (sa.sa_family == AF_INET)
-				{
-					struct sockaddr_in * foo = (struct sockaddr_in *)&sa;
-					inet_ntop(sa.sa_family, &(foo->sin_addr), ClientHostname, INET6_ADDRSTRLEN);
-				}
-				else if (sa.sa_family == AF_INET6)
-				{
-					struct sockaddr_in6 * foo = (struct sockaddr_in6 *)&sa;
-					inet_ntop(sa.sa_family, &(foo->sin6_addr), ClientHostname, INET6_ADDRSTRLEN);
-				}
-				if (ConsoleVerbosity > 0)
-					std::cout << "[" << getTimeISO8601() << "] client (" << ClientHostname << ") says \"" << ClientResponse << "\"" << std::endl;
-				if (ClientResponse.find("\"feature\":\"TIM:ENE\"") != std::string::npos)
-				{
-					// Then I want to add the device to my list to be polled for energy usage
-					CKasaClient NewClient;
-					NewClient.address.sa_family = sa.sa_family;
-					for (long unsigned int index = 0; index < sizeof(NewClient.address.sa_data); index++)
-						NewClient.address.sa_data[index] = sa.sa_data[index];
-					NewClient.date = CurrentTime;
-					NewClient.information = ClientResponse;
-					std::queue<std::string> foo;
-					auto ret = KasaClients.insert(std::pair<CKasaClient, std::queue<std::string>>(NewClient, foo));
-					if (ConsoleVerbosity > 0)
-						if (ret.first->second.empty())
-							std::cout << "[" << getTimeISO8601() << "] adding (" << ClientHostname << ")" << std::endl;
-
-					// This adds reported alias information to the TitleMap
-					std::string Title(NewClient.information);
-					auto pos = Title.find("\"alias\"");
-					if (pos != std::string::npos)
-					{
-						Title.erase(0, pos);
-						Title.erase(Title.find_first_of(",}"));	// truncate value
-						Title.erase(0, Title.find(':'));	// move past key value
-						Title.erase(Title.find(':'), 1);	// move past seperator
-						Title.erase(Title.find('"'), 1);
-						Title.erase(Title.find('"'), 1);
-						KasaTitles.insert(std::pair<std::string, std::string>(NewClient.GetDeviceID(), Title));
-					}
-
-
-					if (ClientResponse.find("\"children\":[") != std::string::npos)
-					{
-						const std::string ssParentID(NewClient.GetDeviceID());
-						//here we need to parse the client request and add a new map entry for each "id"
-						std::string ssChildren(ClientResponse);
-						ssChildren.erase(0, ssChildren.find("\"children\":["));
-						ssChildren.erase(0, ssChildren.find("[")+1);
-						ssChildren.erase(ssChildren.find("]"));
-						std::string ssChild;
-						int count = 0;						
-						for (auto pos = ssChildren.begin(); pos != ssChildren.end(); pos++)
-						{
-							if (!((count == 0) && (*pos == ',')) && (*pos != '\\'))
-							{
-								if (*pos == '{')
-									count++;
-								ssChild += *pos;
-								if (*pos == '}')
-									count--;
-								if (count == 0)
-								{
-									ssChild.insert(ssChild.find("id\":\"")+5, ssParentID);
-									NewClient.information = ssChild;
-									ret = KasaClients.insert(std::pair<CKasaClient, std::queue<std::string>>(NewClient, foo));
-									if (ConsoleVerbosity > 0)
-										if (ret.first->second.empty())
-											std::cout << "[" << getTimeISO8601() << "] adding (" << ClientHostname << ")" << ssChild << std::endl;
-									ssChild.clear();	// http://www.cplusplus.com/reference/string/basic_string/clear/
-									// This adds reported alias information to the TitleMap
-									std::string Title(NewClient.information);
-									auto pos = Title.find("\"alias\"");
-									if (pos != std::string::npos)
-									{
-										Title.erase(0, pos);
-										Title.erase(Title.find_first_of(",}"));	// truncate value
-										Title.erase(0, Title.find(':'));	// move past key value
-										Title.erase(Title.find(':'), 1);	// move past seperator
-										Title.erase(Title.find('"'), 1);
-										Title.erase(Title.find('"'), 1);
-										KasaTitles.insert(std::pair<std::string, std::string>(NewClient.GetDeviceID(), Title));
-									}
-								}
-							}
-						}
-					}
-				}
+				if (TimerExpired(LogTimer))
+					PolledQueue.Push({ CPolledMessage::kind::flush });	// if the queue is full the next timer tries again
 			}
-		}
-
-		if (difftime(CurrentTime, LastQueryTime) > 59) // only do this stuff every so often.
-		{
-			LastQueryTime = CurrentTime;
-
-			for (auto it = KasaClients.begin(); it != KasaClients.end(); ++it)
+			else if (FileDescriptor == SVGTimer)
 			{
-				auto Client = it->first;
-				char ClientHostname[INET6_ADDRSTRLEN] = { 0 };
-				if (Client.address.sa_family == AF_INET)
+				if (TimerExpired(SVGTimer))
 				{
-					struct sockaddr_in * foo = (struct sockaddr_in *)&Client.address;
-					inet_ntop(Client.address.sa_family, &(foo->sin_addr), ClientHostname, INET6_ADDRSTRLEN);
+					PolledQueue.Push({ CPolledMessage::kind::render });
+					ArmSVGTimer(((CurrentTime / DAY_SAMPLE) + 1) * DAY_SAMPLE + 1);	// line up on the next five minute period
 				}
-				else if (Client.address.sa_family == AF_INET6)
+			}
+			else if (FileDescriptor == DisplayTimer)
+			{
+				if (TimerExpired(DisplayTimer))
 				{
-					struct sockaddr_in6 * foo = (struct sockaddr_in6 *)&Client.address;
-					inet_ntop(Client.address.sa_family, &(foo->sin6_addr), ClientHostname, INET6_ADDRSTRLEN);
+					std::cout << "[" << getTimeISO8601() << "]";
+					if (ConsoleVerbosity > 1)
+						std::cout << " queued readings: " << PolledQueue.Depth() << " writes: " << WriterQueue.Depth() << " graphs: " << GraphsQueued.load() << " dropped: " << PolledDropped;
+					std::cout << "\r";
+					std::cout.flush();
 				}
-				struct addrinfo hints;
-				/* Obtain address(es) matching host/port */
-				memset(&hints, 0, sizeof(struct addrinfo));
-				hints.ai_family = AF_UNSPEC;     /* Allow IPv4 or IPv6 */
-				hints.ai_socktype = SOCK_STREAM;
-				hints.ai_protocol = IPPROTO_TCP;
-				struct addrinfo *result;
-				if (getaddrinfo(ClientHostname, "9999", &hints, &result) == 0)
+			}
+			else if (FileDescriptor == RunTimer)
+				bRun = false;
+			else if (FileDescriptor == ResponseQueue.WaitDescriptor())
+				HTTPServer.Answer();
+			else if (HTTPServer.Owns(FileDescriptor))
+				HTTPServer.Event(FileDescriptor, Events[index].events);
+			else
+			{
+				auto Query = KasaQueries.find(FileDescriptor);
+				if (Query != KasaQueries.end())
 				{
-					for (auto rp = result; rp != NULL; rp = rp->ai_next)
+					if (Query->second.Continue(Events[index].events))
 					{
-						int theSocket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-						if (theSocket != -1)
-						{
-							if (connect(theSocket, rp->ai_addr, rp->ai_addrlen) != -1)
-							{	// Success
-								//char NetNameBuf[100] = { 0 };
-								//inet_ntop(rp->ai_addr->sa_family, rp->ai_addr->sa_data, NetNameBuf, sizeof(NetNameBuf));
-								//std::cout << "[" << getTimeISO8601() << "] Connected to: " << NetNameBuf << std::endl;
-								char bufHostName[255] = { 0 };
-								char bufService[255] = { 0 };
-								getnameinfo(rp->ai_addr, rp->ai_addrlen, bufHostName, sizeof(bufHostName), bufService, sizeof(bufService), 0);
-								if (ConsoleVerbosity > 0)
-									std::cout << "[" << getTimeISO8601() << "] [" << bufHostName << ":" << bufService << "]";
-								std::string ssRequest("{\"emeter\":{\"get_realtime\":{}}}");
-								// If we are a child instead of a top level device, we have an "id" instead of a "deviceId" and need to format the request with context data
-								if ((Client.information.find("\"deviceId\"") == std::string::npos) && 
-									(Client.information.find("\"id\"") != std::string::npos))
-								{
-									// Need to build string in the format of: '{"emeter":{"get_realtime":{}},"context":{"child_ids":["8006842B55612405D20D69504A3F43DA1B2A969406"]}}'
-									ssRequest = "{\"emeter\":{\"get_realtime\":{}},\"context\":{\"child_ids\":[\"" + Client.GetDeviceID() + "\"]}}";
-								}
-								uint8_t OutBuffer[1024 * 2] = { 0 };
-								KasaEncrypt(ssRequest, OutBuffer + sizeof(uint32_t));
-								uint32_t * OutBufferLen = (uint32_t *)OutBuffer;
-								*OutBufferLen = htonl(ssRequest.length());
-								size_t bufLen = ssRequest.length() + sizeof(uint32_t);
-								ssize_t nRet = send(theSocket, OutBuffer, bufLen, 0);
-								//if ((ConsoleVerbosity > 0) && (nRet < bufLen))
-								//	std::cout << " not everything was sent in one go!";
-								if (ConsoleVerbosity > 0)
-									std::cout << " (" << nRet << ")=> " << ssRequest;
-								if (nRet == bufLen)
-								{
-									uint8_t InBuffer[1024 * 2] = { 0 };
-									nRet = recv(theSocket, InBuffer, sizeof(InBuffer), 0);
-									if (nRet > 0)
-									{
-										uint32_t * InBufferLen = (uint32_t *)InBuffer;
-										size_t datasize = ntohl(*InBufferLen);
-										if (nRet == (datasize + sizeof(uint32_t)))
-										{
-											std::string Response;
-											KasaDecrypt(nRet - sizeof(uint32_t), InBuffer + sizeof(uint32_t), Response);
-											std::ostringstream LogLine;
-											LogLine << "{\"date\":\"" << timeToExcelDate(CurrentTime) << "\",";
-											LogLine << "\"deviceId\":\"" << Client.GetDeviceID() << "\",";
-											LogLine << Response << "}";
-											it->second.push(LogLine.str());
-											if (ConsoleVerbosity > 0)
-												std::cout << " <=(" << nRet << ") " << Response;
-											CKASAReading theReading(LogLine.str());
-											if (theReading.IsValid())
-												UpdateMRTGData(theReading.GetDeviceID(), theReading);
-										}
-										else
-											bRun = false; // This is a hack. I'm exiting the program on this issue and counting on systemd to restart me
-									}
-									//else if (it->second.empty())
-									//{
-									//	// If the device didn't respond, and we don't have any responses in the queue, let's remove it from the map.
-									//	if (ConsoleVerbosity > 0)
-									//		std::cout << "  No Response. Removing from map.";
-									//	KasaClients.erase(it);
-									//}
-								}
-								else
-									bRun = false; // This is a hack. I'm exiting the program on this issue and counting on systemd to restart me
-								if (ConsoleVerbosity > 0)
-									std::cout << std::endl;
-							}
-							close(theSocket);
-						}
+						KasaPollFailures += Query->second.Unanswered();
+						Query->second.Close();
+						KasaQueries.erase(Query);
 					}
-					freeaddrinfo(result);           /* No longer needed */
-				}
-				else
-				{
-					std::cerr << "[" << getTimeISO8601() << "] Error getaddrinfo " << std::endl;
-					//fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+					else
+						RekeyQuery(KasaQueries, Query);
 				}
 			}
 		}
-
-		if (difftime(CurrentTime, LastLogTime) > LogFileTime) // only do this stuff every so often.
-		{
-			LastLogTime = CurrentTime;
-			GenerateLogFile(KasaClients);
-		}
-
-		if ((!SVGDirectory.empty()) && (difftime(CurrentTime, TimeSVG) > DAY_SAMPLE))
-		{
-			WriteAllSVG();
-			TimeSVG = (CurrentTime / DAY_SAMPLE) * DAY_SAMPLE; // hack to try to line up TimeSVG to be on a five minute period
-		}
-
-		usleep(100); // sleep for 100 microseconds (0.1 ms)
-		if (ConsoleVerbosity > 0)
-			if (difftime(CurrentTime, DisplayTime) > 0) // update display if it's been over a second
-		{
-			DisplayTime = CurrentTime;
-			std::cout << "[" << getTimeISO8601() << "]\r";
-			std::cout.flush();
-		}
-		if (difftime(CurrentTime, StartTime) > RunTime)
-			bRun = false;
 	}
 
-	GenerateLogFile(KasaClients);
+	for (auto& Query : KasaQueries)
+		Query.second.Close();
+	HTTPServer.Close();
+	for (auto TimerDescriptor : { BroadcastTimer, QueryTimer, LogTimer, DisplayTimer, SVGTimer, RunTimer })
+		if (TimerDescriptor != -1)
+			close(TimerDescriptor);
+	close(EventPoll);
+	// Each stage finishes what it has queued, and the writer flushes the log files on the way out
+	PolledQueue.PushWait({ CPolledMessage::kind::stop });
+	Aggregator.join();
+	Writer.join();
+	SVGThreads.Stop();
+	CompressThreads.Stop();
 
 	if (ServerListenSocket != -1)
 	{